@@ -2,6 +2,16 @@
 
 set -xe
 
+mkdir -p ./build/tools
+
+# Headless, needs nothing but libc and pthreads. `./build.sh nn-train` builds
+# only this one, e.g. on machines without raylib.
+clang -O3 -Wall -Wextra -ggdb -I. -o ./build/tools/nn-train tools/nn-train.c -lm -lpthread
+
+if [ "$1" = "nn-train" ]; then
+    exit 0
+fi
+
 CFLAGS="-O3 -Wall -Wextra -ggdb -I./thirdparty/ -I. `pkg-config --cflags raylib`"
 LIBS="-lm `pkg-config --libs raylib` -lglfw -ldl -lpthread"
 
@@ -1,3 +1,5 @@
+#define NN_THREADS
+
 #define GYM_IMPLEMENTATION
 #include "gym.h"
 
@@ -9,12 +11,12 @@
 size_t arch[] = {2*BITS, 4*BITS, BITS + 1};
 size_t epoch = 0;
 size_t max_epoch = 100*1000;
-size_t batches_per_frame = 200;
+double training_budget = 0.008; // Seconds of every frame
 size_t batch_size = 28;
 float rate = 1.0f;
 bool paused = true;
 
-void verify_nn_adder(Font font, NN nn, Gym_Rect r)
+void verify_nn_adder(Font font, Region *temp, NN nn, Gym_Rect r)
 {
     float s;
     if (r.w < r.h) {
@@ -27,21 +29,27 @@ void verify_nn_adder(Font font, NN nn, Gym_Rect r)
     size_t n = 1<<BITS;
     float cs = s/n;
 
+    Mat in = mat_alloc(temp, n*n, 2*BITS);
     for (size_t x = 0; x < n; ++x) {
         for (size_t y = 0; y < n; ++y) {
             for (size_t i = 0; i < BITS; ++i) {
-                ROW_AT(NN_INPUT(nn), i)        = (x>>i)&1;
-                ROW_AT(NN_INPUT(nn), i + BITS) = (y>>i)&1;
+                MAT_AT(in, x*n + y, i)        = (x>>i)&1;
+                MAT_AT(in, x*n + y, i + BITS) = (y>>i)&1;
             }
+        }
+    }
+    Mat out = nn_forward(temp, nn, in);
 
-            nn_forward(nn);
+    for (size_t x = 0; x < n; ++x) {
+        for (size_t y = 0; y < n; ++y) {
+            Row row = mat_row(out, x*n + y);
 
             size_t z = 0.0f;
             for (size_t i = 0; i < BITS; ++i) {
-                size_t bit = ROW_AT(NN_OUTPUT(nn), i) > 0.5;
+                size_t bit = ROW_AT(row, i) > 0.5;
                 z = z|(bit<<i);
             }
-            bool overflow = ROW_AT(NN_OUTPUT(nn), BITS) > 0.5;
+            bool overflow = ROW_AT(row, BITS) > 0.5;
             bool correct = z == x + y;
 
             Vector2 position = { r.x + x*cs, r.y + y*cs };
@@ -67,8 +75,6 @@ void verify_nn_adder(Font font, NN nn, Gym_Rect r)
 
 int main(void)
 {
-    Region temp = region_alloc_alloc(256*1024*1024);
-
     size_t n = (1<<BITS);
     size_t rows = n*n;
     Mat t  = mat_alloc(NULL, rows, 2*BITS + BITS + 1);
@@ -96,6 +102,14 @@ int main(void)
 
     NN nn = nn_alloc(NULL, arch, ARRAY_LEN(arch));
     nn_rand(nn, -1, 1);
+    Optimizer opt = optimizer_alloc(NULL, nn, OPT_SGD, rate);
+
+    Workspace ws = workspace_alloc(NULL, arch, ARRAY_LEN(arch), batch_size);
+
+    // Every frame verifies all the sums and then computes the cost
+    size_t temp_size = region_footprint(sizeof(float)*rows*2*BITS) + nn_forward_bytes(arch, ARRAY_LEN(arch), rows) +
+                       nn_cost_bytes(arch, ARRAY_LEN(arch), t.rows);
+    Region temp = region_alloc_alloc_flags(temp_size, REGION_FIXED);
 
     size_t WINDOW_FACTOR = 80;
     size_t WINDOW_WIDTH = (16*WINDOW_FACTOR);
@@ -109,7 +123,9 @@ int main(void)
     SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
 
     Gym_Plot plot = {0};
+    Gym_Budget budget = gym_budget(training_budget);
     Batch batch = {0};
+    batch_order_alloc(NULL, &batch, t.rows);
 
     while (!WindowShouldClose()) {
         if (IsKeyPressed(KEY_SPACE)) {
@@ -118,15 +134,19 @@ int main(void)
         if (IsKeyPressed(KEY_R)) {
             epoch = 0;
             nn_rand(nn, -1, 1);
+            optimizer_reset(&opt);
             plot.count = 0;
         }
 
-        for (size_t i = 0; i < batches_per_frame && !paused && epoch < max_epoch; ++i) {
-            batch_process(&temp, &batch, batch_size, nn, t, rate);
+        gym_budget_begin(&budget);
+        while (!paused && epoch < max_epoch && gym_budget_next(&budget)) {
+            size_t begin = batch.finished ? 0 : batch.begin;
+            batch_process(&ws, &batch, nn, t, &opt);
+            gym_budget_done(&budget, (batch.finished ? t.rows : batch.begin) - begin);
             if (batch.finished) {
                 epoch += 1;
                 da_append(&plot, batch.cost);
-                mat_shuffle_rows(t);
+                batch_shuffle(&batch);
             }
         }
 
@@ -148,11 +168,11 @@ int main(void)
                     gym_render_nn(nn, gym_layout_slot());
                     gym_render_nn_weights_heatmap(nn, gym_layout_slot());
                 gym_layout_end();
-                verify_nn_adder(font, nn, gym_layout_slot());
+                verify_nn_adder(font, &temp, nn, gym_layout_slot());
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, nn_cost(nn, t), region_occupied_bytes(&temp));
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu, %.0f samples/s\n", epoch, max_epoch, rate, nn_cost(&temp, nn, t), temp_size, budget.samples_per_sec);
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h*0.04, 0, WHITE);
         }
         EndDrawing();
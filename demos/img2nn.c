@@ -10,10 +10,14 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include "stb_image.h"
 #include "stb_image_write.h"
 
+#define NN_THREADS
+
 #define GYM_IMPLEMENTATION
 #include "gym.h"
 
@@ -22,7 +26,7 @@
 
 size_t arch[] = {3, 28, 28, 9, 1};
 size_t max_epoch = 100*1000;
-size_t batches_per_frame = 200;
+size_t checkpoint_epochs = 1000;
 size_t batch_size = 28;
 float rate = 1.0f;
 float scroll = 0.f;
@@ -46,10 +50,10 @@ uint32_t out_pixels[out_width*out_height];
 #define READ_END 0
 #define WRITE_END 1
 
-void render_single_out_image(NN nn, float a)
+void render_single_out_image(Region *r, NN nn, float a, uint32_t *pixels)
 {
     for (size_t i = 0; i < out_width*out_height; ++i) {
-        out_pixels[i] = 0xFF000000;
+        pixels[i] = 0xFF000000;
     }
 
     size_t px, py, size;
@@ -63,33 +67,181 @@ void render_single_out_image(NN nn, float a)
         py = out_height/2 - size/2;
     }
 
-    ROW_AT(NN_INPUT(nn), 2) = a;
-    gym_nn_image_grayscale(nn, &out_pixels[py*out_width + px], size, size, out_width, 0, 1);
+    float in[] = {0, 0, a};
+    gym_nn_image_grayscale(r, nn, (Row) {ARRAY_LEN(in), in}, &pixels[py*out_width + px], size, size, out_width, 0, 1);
 }
 
-int render_upscaled_video(NN nn, float duration, const char *out_file_path)
+// The value of the third input for frame i of the video
+float video_frame_input(size_t i, size_t frame_count)
+{
+    typedef struct {
+        float start;
+        float end;
+    } Segment;
+
+    Segment segments[] = {
+        {0, 0},
+        {0, 1},
+        {1, 1},
+        {1, 0},
+    };
+    size_t segments_count = ARRAY_LEN(segments);
+    float segment_length = 1.0f/segments_count;
+
+    float a = ((float)i)/frame_count;
+    size_t segment_index = floorf(a/segment_length);
+    float segment_progress = a/segment_length - segment_index;
+    if (segment_index >= segments_count) segment_index = segments_count - 1;
+    Segment segment = segments[segment_index];
+    return segment.start + (segment.end - segment.start)*sqrtf(segment_progress);
+}
+
+// Frames that can be rendered ahead of the one ffmpeg is waiting for
+#define VIDEO_RING 16
+#define VIDEO_FRAME_PIXELS (out_width*out_height)
+
+// A video being exported in the background. The workers take the frames in
+// order and render each one into its slot of the ring, the writer streams
+// them to ffmpeg in order. A worker only takes a frame once its slot was
+// written out, so a slow ffmpeg holds the workers back instead of piling up
+// frames.
+typedef struct {
+    NN nn;          // Own copy, the training goes on while exporting
+    size_t frame_count;
+    const char *out_file_path;
+    int fd;         // Write end of the pipe to ffmpeg
+    pid_t child;
+    uint32_t *ring;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool ready[VIDEO_RING];
+    size_t next_frame; // Next one for the workers to take
+    size_t written;    // Frames streamed to ffmpeg so far
+    bool failed;
+    bool finished;
+
+    size_t workers_count;
+    pthread_t *workers;
+    Region *scratch;
+    pthread_t writer;
+    Region mem;
+} Video_Export;
+
+typedef struct {
+    Video_Export *v;
+    size_t index;
+} Video_Worker;
+
+void *video_worker(void *arg)
+{
+    Video_Worker *w = arg;
+    Video_Export *v = w->v;
+    for (;;) {
+        pthread_mutex_lock(&v->mutex);
+        while (!v->failed && v->next_frame < v->frame_count && v->next_frame >= v->written + VIDEO_RING) {
+            pthread_cond_wait(&v->cond, &v->mutex);
+        }
+        if (v->failed || v->next_frame >= v->frame_count) {
+            pthread_mutex_unlock(&v->mutex);
+            break;
+        }
+        size_t i = v->next_frame++;
+        pthread_mutex_unlock(&v->mutex);
+
+        render_single_out_image(&v->scratch[w->index], v->nn, video_frame_input(i, v->frame_count), &v->ring[(i%VIDEO_RING)*VIDEO_FRAME_PIXELS]);
+
+        pthread_mutex_lock(&v->mutex);
+        v->ready[i%VIDEO_RING] = true;
+        pthread_cond_broadcast(&v->cond);
+        pthread_mutex_unlock(&v->mutex);
+    }
+    return NULL;
+}
+
+// write() may take only a part of the frame, e.g. when the pipe is almost full
+bool write_all(int fd, const void *data, size_t size)
+{
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = write(fd, p, size);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+void *video_writer(void *arg)
+{
+    Video_Export *v = arg;
+    bool ok = true;
+    for (size_t i = 0; i < v->frame_count; ++i) {
+        size_t slot = i%VIDEO_RING;
+        pthread_mutex_lock(&v->mutex);
+        while (!v->ready[slot]) {
+            pthread_cond_wait(&v->cond, &v->mutex);
+        }
+        pthread_mutex_unlock(&v->mutex);
+
+        if (!write_all(v->fd, &v->ring[slot*VIDEO_FRAME_PIXELS], sizeof(*v->ring)*VIDEO_FRAME_PIXELS)) {
+            fprintf(stderr, "ERROR: could not write frame %zu to ffmpeg: %s\n", i, strerror(errno));
+            ok = false;
+        }
+
+        pthread_mutex_lock(&v->mutex);
+        v->ready[slot] = false;
+        v->written = i + 1;
+        if (!ok) v->failed = true;
+        pthread_cond_broadcast(&v->cond);
+        pthread_mutex_unlock(&v->mutex);
+        if (!ok) break;
+    }
+
+    close(v->fd);
+    int status;
+    if (waitpid(v->child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) ok = false;
+    if (ok) {
+        printf("Generated %s!\n", v->out_file_path);
+    } else {
+        fprintf(stderr, "ERROR: could not generate %s\n", v->out_file_path);
+    }
+
+    pthread_mutex_lock(&v->mutex);
+    v->finished = true;
+    pthread_mutex_unlock(&v->mutex);
+    return NULL;
+}
+
+Video_Export *video_export_start(NN nn, float duration, const char *out_file_path)
 {
     int pipefd[2];
 
     if (pipe(pipefd) < 0) {
         fprintf(stderr, "ERROR: could not create a pipe: %s\n", strerror(errno));
-        return 1;
+        return NULL;
     }
 
     pid_t child = fork();
     if (child < 0) {
         fprintf(stderr, "ERROR: could not fork a child: %s\n", strerror(errno));
-        return 1;
+        close(pipefd[READ_END]);
+        close(pipefd[WRITE_END]);
+        return NULL;
     }
 
     if (child == 0) {
         if (dup2(pipefd[READ_END], STDIN_FILENO) < 0) {
             fprintf(stderr, "ERROR: could not reopen read end of pipe as stdin: %s\n", strerror(errno));
-            return 1;
+            _exit(1);
         }
+        close(pipefd[READ_END]);
         close(pipefd[WRITE_END]);
 
-        int ret = execlp("ffmpeg",
+        execlp("ffmpeg",
             "ffmpeg",
             "-loglevel", "verbose",
             "-y",
@@ -103,51 +255,76 @@ int render_upscaled_video(NN nn, float duration, const char *out_file_path)
             out_file_path,
             NULL
         );
-        if (ret < 0) {
-            fprintf(stderr, "ERROR: could not run ffmpeg as a child process: %s\n", strerror(errno));
-            return 1;
-        }
-        assert(0 && "unreachable");
+        fprintf(stderr, "ERROR: could not run ffmpeg as a child process: %s\n", strerror(errno));
+        _exit(1);
     }
 
     close(pipefd[READ_END]);
+    // A dead ffmpeg should fail the write() rather than kill the whole demo
+    signal(SIGPIPE, SIG_IGN);
+
+    Video_Export *v = malloc(sizeof(*v));
+    assert(v != NULL);
+    memset(v, 0, sizeof(*v));
+    v->frame_count = FPS*duration;
+    v->out_file_path = out_file_path;
+    v->fd = pipefd[WRITE_END];
+    v->child = child;
+    v->nn = nn_alloc(&v->mem, nn.arch, nn.arch_count);
+    nn_copy(v->nn, nn);
+    v->ring = region_alloc(&v->mem, sizeof(*v->ring)*VIDEO_RING*VIDEO_FRAME_PIXELS);
+    assert(v->ring != NULL);
+    pthread_mutex_init(&v->mutex, NULL);
+    pthread_cond_init(&v->cond, NULL);
+
+    // The workers render a frame each at the same time. The thread pool runs
+    // a gym_nn_image_grayscale() serially while it's busy with another one,
+    // so it's frames rather than scanlines that go in parallel.
+    v->workers_count = nn_threads_count();
+    v->workers = region_alloc(&v->mem, sizeof(*v->workers)*v->workers_count);
+    Video_Worker *args = region_alloc(&v->mem, sizeof(*args)*v->workers_count);
+    v->scratch = region_alloc(&v->mem, sizeof(*v->scratch)*v->workers_count);
+    assert(v->workers != NULL && args != NULL && v->scratch != NULL);
+    size_t scratch_size = gym_nn_image_grayscale_bytes(nn.arch, nn.arch_count, out_width < out_height ? out_width : out_height);
+    for (size_t i = 0; i < v->workers_count; ++i) {
+        v->scratch[i] = region_alloc_alloc_flags(scratch_size, REGION_FIXED);
+        args[i] = (Video_Worker) {v, i};
+        int ret = pthread_create(&v->workers[i], NULL, video_worker, &args[i]);
+        assert(ret == 0);
+    }
+    int ret = pthread_create(&v->writer, NULL, video_writer, v);
+    assert(ret == 0);
 
-    typedef struct {
-        float start;
-        float end;
-    } Segment;
+    return v;
+}
 
-    Segment segments[] = {
-        {0, 0},
-        {0, 1},
-        {1, 1},
-        {1, 0},
-    };
-    size_t segments_count = ARRAY_LEN(segments);
-    float segment_length = 1.0f/segments_count;
+// Whether the export is over, *written is how far it got
+bool video_export_poll(Video_Export *v, size_t *written)
+{
+    pthread_mutex_lock(&v->mutex);
+    bool finished = v->finished;
+    *written = v->written;
+    pthread_mutex_unlock(&v->mutex);
+    return finished;
+}
 
-    size_t frame_count = FPS*duration;
-    for (size_t i = 0; i < frame_count; ++i) {
-        float a = ((float)i)/frame_count;
-        size_t segment_index = floorf(a/segment_length);
-        float segment_progress = a/segment_length - segment_index;
-        if (segment_index > segments_count) segment_index = segment_length - 1;
-        Segment segment = segments[segment_index];
-        float b = segment.start + (segment.end - segment.start)*sqrtf(segment_progress);
-        render_single_out_image(nn, b);
-        write(pipefd[WRITE_END], out_pixels, sizeof(*out_pixels)*out_width*out_height);
-        printf("a = %f, index = %zu, progress = %f, b = %f\n", a, segment_index, segment_progress, b);
+// Waits for the export to be over
+void video_export_free(Video_Export *v)
+{
+    for (size_t i = 0; i < v->workers_count; ++i) {
+        pthread_join(v->workers[i], NULL);
+        region_free(&v->scratch[i]);
     }
-
-    close(pipefd[WRITE_END]);
-    wait(NULL);
-    printf("Generated %s!\n", out_file_path);
-    return 0;
+    pthread_join(v->writer, NULL);
+    pthread_cond_destroy(&v->cond);
+    pthread_mutex_destroy(&v->mutex);
+    region_free(&v->mem);
+    free(v);
 }
 
-int render_upscaled_screenshot(NN nn, const char *out_file_path)
+int render_upscaled_screenshot(Region *r, NN nn, const char *out_file_path)
 {
-    render_single_out_image(nn, scroll);
+    render_single_out_image(r, nn, scroll, out_pixels);
 
     if (!stbi_write_png(out_file_path, out_width, out_height, 4, out_pixels, out_width*sizeof(*out_pixels))) {
         fprintf(stderr, "ERROR: could not save image %s\n", out_file_path);
@@ -158,6 +335,35 @@ int render_upscaled_screenshot(NN nn, const char *out_file_path)
     return 0;
 }
 
+// Everything the trainer thread works on. The UI only touches it with the
+// trainer locked and renders the snapshots instead of nn.
+typedef struct {
+    NN nn;
+    Mat t;
+    Workspace ws;
+    Batch batch;
+    Optimizer opt;
+    Checkpoint *checkpoint;
+    size_t epoch;
+    Gym_Plot plot;
+} Training;
+
+bool training_step(void *arg)
+{
+    Training *tr = arg;
+    if (paused || tr->epoch >= max_epoch) return false;
+
+    tr->opt.rate = rate;
+    batch_process(&tr->ws, &tr->batch, tr->nn, tr->t, &tr->opt);
+    if (tr->batch.finished) {
+        tr->epoch += 1;
+        da_append(&tr->plot, tr->batch.cost);
+        batch_shuffle(&tr->batch);
+        if (tr->epoch%checkpoint_epochs == 0) checkpoint_save(tr->checkpoint, tr->nn, &tr->opt, &tr->batch, tr->epoch);
+    }
+    return true;
+}
+
 typedef enum {
     GHA_LEFT,
     GHA_RIGHT,
@@ -219,8 +425,6 @@ Vector2 render_texture_in_slot(Texture2D texture, Gym_Horz_Align ha, Gym_Vert_Al
 
 int main(int argc, char **argv)
 {
-    Region temp = region_alloc_alloc(256*1024*1024);
-
     const char *program = args_shift(&argc, &argv);
 
     if (argc <= 0) {
@@ -287,6 +491,12 @@ int main(int argc, char **argv)
 
     nn_rand(nn, -1, 1);
 
+    Training tr = {
+        .nn = nn,
+        .t = t,
+        .opt = optimizer_alloc(NULL, nn, OPT_SGD, rate),
+    };
+
     size_t WINDOW_FACTOR = 80;
     size_t WINDOW_WIDTH = (16*WINDOW_FACTOR);
     size_t WINDOW_HEIGHT = (9*WINDOW_FACTOR);
@@ -295,13 +505,23 @@ int main(int argc, char **argv)
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "gym");
     SetTargetFPS(60);
 
-    Gym_Plot plot = {0};
     Font font = LoadFontEx("./fonts/iosevka-regular.ttf", 72, NULL, 0);
     SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
 
     size_t preview_width = 28;
     size_t preview_height = 28;
 
+    tr.ws = workspace_alloc(NULL, arch, ARRAY_LEN(arch), batch_size);
+
+    // The previews and the upscaled output share one temporary region
+    size_t temp_size = 0;
+    size_t image_widths[] = {preview_width, out_width < out_height ? out_width : out_height};
+    for (size_t i = 0; i < ARRAY_LEN(image_widths); ++i) {
+        size_t image_size = gym_nn_image_grayscale_bytes(arch, ARRAY_LEN(arch), image_widths[i]);
+        if (temp_size < image_size) temp_size = image_size;
+    }
+    Region temp = region_alloc_alloc_flags(temp_size, REGION_FIXED);
+
     Image preview_image1 = GenImageColor(preview_width, preview_height, BLACK);
     Texture2D preview_texture1 = LoadTextureFromImage(preview_image1);
 
@@ -333,46 +553,77 @@ int main(int argc, char **argv)
     }
     Texture2D original_texture2 = LoadTextureFromImage(original_image2);
 
-    Batch batch = {0};
+    batch_order_alloc(NULL, &tr.batch, t.rows);
+    tr.checkpoint = checkpoint_alloc(NULL, "img2nn", 3, nn, &tr.opt, &tr.batch);
     bool rate_dragging = false;
     bool scroll_dragging = false;
-    size_t epoch = 0;
+    Checkpoint_Resume resume = checkpoint_resume(tr.checkpoint, nn, &tr.opt, &tr.batch, &tr.epoch);
+    if (resume == CHECKPOINT_FAILED) {
+        fprintf(stderr, "ERROR: could not resume from the checkpoints img2nn-*.nn, move them away to start over\n");
+        checkpoint_free(tr.checkpoint);
+        CloseWindow();
+        return 1;
+    }
+    if (resume == CHECKPOINT_RESUMED) {
+        rate = tr.opt.rate;
+        printf("Resumed from epoch %zu\n", tr.epoch);
+    }
+    Gym_Trainer *trainer = gym_trainer_alloc(NULL, nn, training_step, &tr);
+    Video_Export *video = NULL;
+    size_t video_written = 0;
 
     while (!WindowShouldClose()) {
+        bool changed = false;
+        gym_trainer_lock(trainer);
         if (IsKeyPressed(KEY_SPACE)) {
             paused = !paused;
         }
         if (IsKeyPressed(KEY_R)) {
-            epoch = 0;
+            tr.epoch = 0;
             nn_rand(nn, -1, 1);
-            plot.count = 0;
+            optimizer_reset(&tr.opt);
+            tr.plot.count = 0;
+            changed = true;
         }
-        if (IsKeyPressed(KEY_S)) {
-            render_upscaled_screenshot(nn, "upscaled.png");
+        if (IsKeyPressed(KEY_M)) {
+            if (nn_save("img2nn.nn", nn)) printf("Saved img2nn.nn\n");
         }
-        if (IsKeyPressed(KEY_X)) {
-            render_upscaled_video(nn, 5, "upscaled.mp4");
+        if (IsKeyPressed(KEY_L)) {
+            if (nn_load("img2nn.nn", nn)) {
+                optimizer_reset(&tr.opt);
+                printf("Loaded img2nn.nn\n");
+                changed = true;
+            }
         }
+        gym_trainer_unlock(trainer, changed);
 
-        for (size_t i = 0; i < batches_per_frame && !paused && epoch < max_epoch; ++i) {
-            batch_process(&temp, &batch, batch_size, nn, t, rate);
-            if (batch.finished) {
-                epoch += 1;
-                da_append(&plot, batch.cost);
-                mat_shuffle_rows(t);
-            }
+        // The rendering only reads the latest snapshot and never waits for the training
+        NN view = gym_trainer_snapshot(trainer);
+        if (IsKeyPressed(KEY_S)) {
+            render_upscaled_screenshot(&temp, view, "upscaled.png");
         }
+        if (IsKeyPressed(KEY_X) && video == NULL) {
+            video = video_export_start(view, 5, "upscaled.mp4");
+        }
+        if (video != NULL && video_export_poll(video, &video_written)) {
+            video_export_free(video);
+            video = NULL;
+        }
+
+        // The third input picks the image, the first two are filled in per pixel
+        float in[] = {0, 0, 0};
+        Row in_row = {ARRAY_LEN(in), in};
 
-        ROW_AT(NN_INPUT(nn), 2) = 0.f;
-        gym_nn_image_grayscale(nn, preview_image1.data, preview_image1.width, preview_image1.height, preview_image1.width, 0, 1);
+        ROW_AT(in_row, 2) = 0.f;
+        gym_nn_image_grayscale(&temp, view, in_row, preview_image1.data, preview_image1.width, preview_image1.height, preview_image1.width, 0, 1);
         UpdateTexture(preview_texture1, preview_image1.data);
 
-        ROW_AT(NN_INPUT(nn), 2) = 1.f;
-        gym_nn_image_grayscale(nn, preview_image2.data, preview_image2.width, preview_image2.height, preview_image2.width, 0, 1);
+        ROW_AT(in_row, 2) = 1.f;
+        gym_nn_image_grayscale(&temp, view, in_row, preview_image2.data, preview_image2.width, preview_image2.height, preview_image2.width, 0, 1);
         UpdateTexture(preview_texture2, preview_image2.data);
 
-        ROW_AT(NN_INPUT(nn), 2) = scroll;
-        gym_nn_image_grayscale(nn, preview_image3.data, preview_image3.width, preview_image3.height, preview_image3.width, 0, 1);
+        ROW_AT(in_row, 2) = scroll;
+        gym_nn_image_grayscale(&temp, view, in_row, preview_image3.data, preview_image3.width, preview_image3.height, preview_image3.width, 0, 1);
         UpdateTexture(preview_texture3, preview_image3.data);
 
         BeginDrawing();
@@ -388,8 +639,10 @@ int main(int argc, char **argv)
             r.y = h/2 - r.h/2;
 
             gym_layout_begin(GLO_HORZ, r, 3, 10);
-                gym_plot(plot, gym_layout_slot(), RED);
-                gym_render_nn_weights_heatmap(nn, gym_layout_slot());
+                gym_trainer_lock(trainer);
+                gym_plot(tr.plot, gym_layout_slot(), RED);
+                gym_trainer_unlock(trainer, false);
+                gym_render_nn_weights_heatmap(view, gym_layout_slot());
                 Gym_Rect preview_slot = gym_layout_slot();
                 gym_layout_begin(GLO_VERT, preview_slot, 3, 0);
                     gym_layout_begin(GLO_HORZ, gym_layout_slot(), 2, 0);
@@ -412,14 +665,24 @@ int main(int argc, char **argv)
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", epoch, max_epoch, rate, plot.count > 0 ? plot.items[plot.count - 1] : 0, region_occupied_bytes(&temp));
+            gym_trainer_lock(trainer);
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu\n", tr.epoch, max_epoch, rate, tr.plot.count > 0 ? tr.plot.items[tr.plot.count - 1] : 0, temp_size);
             DrawTextEx(font, buffer, CLITERAL(Vector2) {}, h*0.04, 0, WHITE);
+            if (video != NULL) {
+                snprintf(buffer, sizeof(buffer), "Exporting video: %zu/%zu frames", video_written, video->frame_count);
+                DrawTextEx(font, buffer, CLITERAL(Vector2) {0, h*0.12}, h*0.04, 0, WHITE);
+            }
             gym_slider(&rate, &rate_dragging, 0, h*0.08, w, h*0.02);
+            gym_trainer_unlock(trainer, false);
         }
         EndDrawing();
 
         region_reset(&temp);
     }
 
+    if (video != NULL) video_export_free(video);
+    gym_trainer_free(trainer);
+    checkpoint_free(tr.checkpoint);
+
     return 0;
 }
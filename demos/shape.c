@@ -7,6 +7,7 @@
 
 #define NN_BACKPROP_TRADITIONAL
 #define NN_ACT ACT_SIG
+#define NN_THREADS
 
 #define GYM_IMPLEMENTATION
 #include "gym.h"
@@ -28,7 +29,7 @@ enum {
 
 size_t arch[] = {WIDTH*HEIGHT, 14, 7, 5, SHAPES};
 size_t batch_size = 20;
-size_t batches_per_frame = 20;
+double training_budget = 0.008; // Seconds of every frame
 float rate = 0.1f;
 bool paused = true;
 
@@ -165,17 +166,25 @@ int main(void)
 {
     srand(time(0));
 
-    Region temp = region_alloc_alloc(256*1024*1024);
-    Region main = region_alloc_alloc(256*1024*1024);
+    Region main = {0};
 
     NN nn = nn_alloc(&main, arch, ARRAY_LEN(arch));
     nn_rand(nn, -1, 1);
+    Optimizer opt = optimizer_alloc(&main, nn, OPT_SGD, rate);
     Mat t = generate_samples(&main, TRAINING_SAMPLES_PER_SHAPE);
     Mat v = generate_samples(&main, VERIFICATION_SAMPLES_PER_SHAPE);
 
     Gym_Plot tplot = {0};
     Gym_Plot vplot = {0};
     Batch batch = {0};
+    batch_order_alloc(&main, &batch, t.rows);
+
+    Workspace ws = workspace_alloc(&main, arch, ARRAY_LEN(arch), batch_size);
+
+    size_t temp_size = nn_cost_bytes(arch, ARRAY_LEN(arch), v.rows);
+    size_t frame_size = region_footprint(sizeof(float)*WIDTH*HEIGHT) + nn_forward_bytes(arch, ARRAY_LEN(arch), 1);
+    if (temp_size < frame_size) temp_size = frame_size;
+    Region temp = region_alloc_alloc_flags(temp_size, REGION_FIXED);
 
     int factor = 80;
     SetConfigFlags(FLAG_WINDOW_RESIZABLE);
@@ -189,12 +198,15 @@ int main(void)
     canvas.stride = WIDTH;
     olivec_fill(canvas, BACKGROUND_COLOR);
 
+    Gym_Budget budget = gym_budget(training_budget);
+
     while (!WindowShouldClose()) {
         if (IsKeyPressed(KEY_SPACE)) {
             paused = !paused;
         }
         if (IsKeyPressed(KEY_R)) {
             nn_rand(nn, -1, 1);
+            optimizer_reset(&opt);
             tplot.count = 0;
             vplot.count = 0;
         }
@@ -207,37 +219,54 @@ int main(void)
         if (IsKeyPressed(KEY_W)) {
             random_rect(canvas);
         }
+        if (IsKeyPressed(KEY_S)) {
+            if (nn_save("shape.nn", nn)) printf("Saved shape.nn\n");
+        }
+        if (IsKeyPressed(KEY_L)) {
+            if (nn_load("shape.nn", nn)) {
+                optimizer_reset(&opt);
+                printf("Loaded shape.nn\n");
+            }
+        }
 
-        for (size_t i = 0; i < batches_per_frame && !paused; ++i) {
-            size_t s = region_save(&temp);
-            batch_process(&temp, &batch, batch_size, nn, t, rate);
+        gym_budget_begin(&budget);
+        while (!paused && gym_budget_next(&budget)) {
+            size_t begin = batch.finished ? 0 : batch.begin;
+            batch_process(&ws, &batch, nn, t, &opt);
+            gym_budget_done(&budget, (batch.finished ? t.rows : batch.begin) - begin);
             if (batch.finished) {
                 da_append(&tplot, batch.cost);
-                mat_shuffle_rows(t);
-                da_append(&vplot, nn_cost(nn, v));
+                batch_shuffle(&batch);
+                da_append(&vplot, nn_cost(&temp, nn, v));
             }
-            region_rewind(&temp, s);
         }
 
         BeginDrawing();
             ClearBackground(GYM_BACKGROUND);
             gym_layout_begin(GLO_HORZ, gym_root(), 2, 10);
                 gym_layout_begin(GLO_VERT, gym_layout_slot(), 2, 10);
-                    gym_plot(tplot, gym_layout_slot(), RED);
+                    {
+                        Gym_Rect slot = gym_layout_slot();
+                        gym_plot(tplot, slot, RED);
+                        DrawText(TextFormat("%.0f samples/s", budget.samples_per_sec), slot.x, slot.y, slot.h*0.08, WHITE);
+                    }
                     gym_plot(vplot, gym_layout_slot(), GREEN);
                 gym_layout_end();
                 gym_layout_begin(GLO_VERT, gym_layout_slot(), 2, 10);
                     gym_drawable_canvas(canvas, gym_layout_slot());
-                    canvas_to_row(NN_INPUT(nn), canvas);
-                    nn_forward(nn);
                     {
+                        size_t s = region_save(&temp);
+                        Row in = row_alloc(&temp, WIDTH*HEIGHT);
+                        canvas_to_row(in, canvas);
+                        Row out = mat_row(nn_forward(&temp, nn, row_as_mat(in)), 0);
                         Gym_Rect slot = gym_layout_slot();
-                        gym_render_mat_as_heatmap(row_as_mat(NN_OUTPUT(nn)), slot, NN_OUTPUT(nn).cols);
-                        if (ROW_AT(NN_OUTPUT(nn), 0) > ROW_AT(NN_OUTPUT(nn), 1)) {
+                        gym_render_mat_as_heatmap(row_as_mat(out), slot, out.cols);
+                        if (ROW_AT(out, 0) > ROW_AT(out, 1)) {
                             DrawText("circle", slot.x, slot.y, slot.h*0.08, WHITE);
-                        } else if (ROW_AT(NN_OUTPUT(nn), 0) < ROW_AT(NN_OUTPUT(nn), 1)) {
+                        } else if (ROW_AT(out, 0) < ROW_AT(out, 1)) {
                             DrawText("rectangle", slot.x, slot.y, slot.h*0.08, WHITE);
                         }
+                        region_rewind(&temp, s);
                     }
                 gym_layout_end();
             gym_layout_end();
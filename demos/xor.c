@@ -6,21 +6,27 @@
 
 size_t arch[] = {2, 2, 1};
 size_t max_epoch = 100*1000;
-size_t epochs_per_frame = 103;
+double training_budget = 0.008; // Seconds of every frame
 float rate = 1.0f;
 bool paused = true;
 
-void verify_nn_gate(Font font, NN nn, Gym_Rect r)
+void verify_nn_gate(Font font, Region *temp, NN nn, Gym_Rect r)
 {
+    Mat in = mat_alloc(temp, 4, 2);
+    for (size_t i = 0; i < 2; ++i) {
+        for (size_t j = 0; j < 2; ++j) {
+            MAT_AT(in, i*2 + j, 0) = i;
+            MAT_AT(in, i*2 + j, 1) = j;
+        }
+    }
+    Mat out = nn_forward(temp, nn, in);
+
     char buffer[256];
     float s = r.h*0.06;
     float pad = r.h*0.03;
     for (size_t i = 0; i < 2; ++i) {
         for (size_t j = 0; j < 2; ++j) {
-            ROW_AT(NN_INPUT(nn), 0) = i;
-            ROW_AT(NN_INPUT(nn), 1) = j;
-            nn_forward(nn);
-            snprintf(buffer, sizeof(buffer), "%zu @ %zu == %f", i, j, ROW_AT(NN_OUTPUT(nn), 0));
+            snprintf(buffer, sizeof(buffer), "%zu @ %zu == %f", i, j, MAT_AT(out, i*2 + j, 0));
             DrawTextEx(font, buffer, CLITERAL(Vector2){r.x, r.y + (i*2 + j)*(s + pad)}, s, 0, WHITE);
         }
     }
@@ -28,8 +34,6 @@ void verify_nn_gate(Font font, NN nn, Gym_Rect r)
 
 int main(void)
 {
-    Region temp = region_alloc_alloc(256*1024*1024);
-
     Mat t = mat_alloc(NULL, 4, 3);
     for (size_t i = 0; i < 2; ++i) {
         for (size_t j = 0; j < 2; ++j) {
@@ -43,6 +47,13 @@ int main(void)
     NN nn = nn_alloc(NULL, arch, ARRAY_LEN(arch));
     nn_rand(nn, -1, 1);
 
+    Workspace ws = workspace_alloc(NULL, arch, ARRAY_LEN(arch), t.rows);
+
+    // Every frame verifies the gate and then computes the cost
+    size_t temp_size = region_footprint(sizeof(float)*4*2) + nn_forward_bytes(arch, ARRAY_LEN(arch), 4) +
+                       nn_cost_bytes(arch, ARRAY_LEN(arch), t.rows);
+    Region temp = region_alloc_alloc_flags(temp_size, REGION_FIXED);
+
     size_t WINDOW_FACTOR = 80;
     size_t WINDOW_WIDTH = (16*WINDOW_FACTOR);
     size_t WINDOW_HEIGHT = (9*WINDOW_FACTOR);
@@ -55,6 +66,7 @@ int main(void)
     SetTextureFilter(font.texture, TEXTURE_FILTER_BILINEAR);
 
     Gym_Plot plot = {0};
+    Gym_Budget budget = gym_budget(training_budget);
 
     size_t epoch = 0;
     while (!WindowShouldClose()) {
@@ -67,11 +79,14 @@ int main(void)
             plot.count = 0;
         }
 
-        for (size_t i = 0; i < epochs_per_frame && !paused && epoch < max_epoch; ++i) {
-            NN g = nn_backprop(&temp, nn, t);
+        gym_budget_begin(&budget);
+        while (!paused && epoch < max_epoch && gym_budget_next(&budget)) {
+            float c;
+            NN g = nn_backprop_ws(&ws, nn, t, &c);
             nn_learn(nn, g, rate);
             epoch += 1;
-            da_append(&plot, nn_cost(nn, t));
+            da_append(&plot, c);
+            gym_budget_done(&budget, t.rows);
         }
 
         BeginDrawing();
@@ -89,11 +104,11 @@ int main(void)
             gym_layout_begin(GLO_HORZ, r, 3, 10);
                 gym_plot(plot, gym_layout_slot(), RED);
                 gym_render_nn(nn, gym_layout_slot());
-                verify_nn_gate(font, nn, gym_layout_slot());
+                verify_nn_gate(font, &temp, nn, gym_layout_slot());
             gym_layout_end();
 
             char buffer[256];
-            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu bytes", epoch, max_epoch, rate, nn_cost(nn, t), region_occupied_bytes(&temp));
+            snprintf(buffer, sizeof(buffer), "Epoch: %zu/%zu, Rate: %f, Cost: %f, Temporary Memory: %zu bytes, %.0f samples/s", epoch, max_epoch, rate, nn_cost(&temp, nn, t), temp_size, budget.samples_per_sec);
             DrawTextEx(font, buffer, CLITERAL(Vector2){}, h*0.04, 0, WHITE);
         }
         EndDrawing();
@@ -15,6 +15,15 @@
 #define GYM_ASSERT NN_ASSERT
 #endif // GYM_ASSERT
 
+#ifndef GYM_IMAGE_TILE_PIXELS
+#define GYM_IMAGE_TILE_PIXELS 1024
+#endif // GYM_IMAGE_TILE_PIXELS
+
+// How often Gym_Budget.samples_per_sec is updated, in seconds
+#ifndef GYM_BUDGET_REPORT_SECS
+#define GYM_BUDGET_REPORT_SECS 0.5
+#endif // GYM_BUDGET_REPORT_SECS
+
 // The Tsoding Background Color
 #define GYM_BACKGROUND CLITERAL(Color) { 0x18, 0x18, 0x18, 0xFF }
 
@@ -85,12 +94,83 @@ void gym_render_nn_weights_heatmap(NN nn, Gym_Rect r);
 void gym_render_nn_activations_heatmap(NN nn, Gym_Rect r);
 void gym_plot(Gym_Plot plot, Gym_Rect r, Color c);
 void gym_slider(float *value, bool *dragging, float rx, float ry, float rw, float rh);
-void gym_nn_image_grayscale(NN nn, void *pixels, size_t width, size_t height, size_t stride, float low, float high);
+// Renders the first output of nn over the (x, y) coordinates of the image in
+// the first two inputs. The rest of the inputs are taken from in, which has
+// a column for every input of nn. Tiles of scanlines are forwarded as
+// batches across the nn.h thread pool with scratch memory from r. Neither nn
+// nor in are written to, so nn may be shared with other threads that only
+// read it too.
+void gym_nn_image_grayscale(Region *r, NN nn, Row in, void *pixels, size_t width, size_t height, size_t stride, float low, float high);
+// Peak bytes of r gym_nn_image_grayscale() needs for an image of that width, see nn_alloc_bytes()
+size_t gym_nn_image_grayscale_bytes(size_t *arch, size_t arch_count, size_t width);
+
+// Trains for a slice of every frame rather than for a fixed amount of
+// batches. Every batch is timed with GetTime(), and the next one only starts
+// if the running average of their times still fits into what's left of the
+// budget, so the amount of batches follows the machine, the arch and the
+// batch size on its own:
+//
+//     gym_budget_begin(&budget);
+//     while (!paused && gym_budget_next(&budget)) {
+//         batch_process(&ws, &batch, nn, t, &opt);
+//         gym_budget_done(&budget, ws.rows);
+//     }
+typedef struct {
+    double budget;          // Seconds of every frame that go to the training
+    double batch_secs;      // Running average of the seconds per batch
+    double samples_per_sec; // Achieved in real time, including the rendering
+    double frame_start;
+    double batch_start;
+    size_t batches;         // Started in this frame
+    size_t samples;
+    double report_start;
+} Gym_Budget;
+
+Gym_Budget gym_budget(double budget);
+void gym_budget_begin(Gym_Budget *b);
+// Whether there is time for one more batch. The first batch of a frame
+// always runs, so the training never stops completely.
+bool gym_budget_next(Gym_Budget *b);
+// Ends the batch that gym_budget_next() allowed, which trained on that many samples
+void gym_budget_done(Gym_Budget *b, size_t samples);
+
+#ifdef NN_THREADS
+// Trains on a thread of its own, so a slow frame doesn't stall the training
+// and heavy training doesn't drop frames. The trainer calls step() back to
+// back with itself locked. step() returns false when there is nothing to
+// train (e.g. paused or done), and the trainer then sleeps until the next
+// gym_trainer_unlock().
+//
+// The parameters are published through a triple buffer of snapshots. The
+// UI renders gym_trainer_snapshot() without ever waiting for the trainer.
+// Everything step() touches may only be changed by the UI between
+// gym_trainer_lock() and gym_trainer_unlock(), which wait for at most one
+// step.
+typedef bool (*Gym_Train_Step)(void *arg);
+typedef struct Gym_Trainer Gym_Trainer;
+
+Gym_Trainer *gym_trainer_alloc(Region *r, NN nn, Gym_Train_Step step, void *arg);
+// Latest published parameters of nn. Only the UI thread may call it, and
+// the NN stays valid until the next call.
+NN gym_trainer_snapshot(Gym_Trainer *t);
+void gym_trainer_lock(Gym_Trainer *t);
+// changed tells that the UI wrote into the parameters of nn (e.g. reset or
+// loaded them), so they get published even while step() trains nothing.
+// Otherwise a snapshot is only copied after the steps that trained.
+void gym_trainer_unlock(Gym_Trainer *t, bool changed);
+// Stops the trainer after the step it's in the middle of
+void gym_trainer_free(Gym_Trainer *t);
+#endif // NN_THREADS
 
 #endif // GYM_H_
 
 #ifdef GYM_IMPLEMENTATION
 
+#ifdef NN_THREADS
+#include <pthread.h>
+#include <stdatomic.h>
+#endif // NN_THREADS
+
 void gym_render_nn(NN nn, Gym_Rect r)
 {
     Color low_color = RED;
@@ -105,13 +185,13 @@ void gym_render_nn(NN nn, Gym_Rect r)
     float nn_y = r.y + r.h/2 - nn_height/2;
     float layer_hpad = nn_width / nn.arch_count;
     for (size_t l = 0; l < nn.arch_count; ++l) {
-        float layer_vpad1 = nn_height / nn.as[l].cols;
-        for (size_t i = 0; i < nn.as[l].cols; ++i) {
+        float layer_vpad1 = nn_height / nn.arch[l];
+        for (size_t i = 0; i < nn.arch[l]; ++i) {
             float cx1 = nn_x + l*layer_hpad + layer_hpad/2;
             float cy1 = nn_y + i*layer_vpad1 + layer_vpad1/2;
             if (l+1 < nn.arch_count) {
-                float layer_vpad2 = nn_height / nn.as[l+1].cols;
-                for (size_t j = 0; j < nn.as[l+1].cols; ++j) {
+                float layer_vpad2 = nn_height / nn.arch[l+1];
+                for (size_t j = 0; j < nn.arch[l+1]; ++j) {
                     // i - rows of ws
                     // j - cols of ws
                     float cx2 = nn_x + (l+1)*layer_hpad + layer_hpad/2;
@@ -259,23 +339,262 @@ void gym_slider(float *value, bool *dragging, float rx, float ry, float rw, floa
     }
 }
 
-void gym_nn_image_grayscale(NN nn, void *pixels, size_t width, size_t height, size_t stride, float low, float high)
+typedef struct {
+    NN nn;
+    Row in;
+    uint32_t *pixels;
+    size_t width;
+    size_t height;
+    size_t stride;
+    float low;
+    float high;
+    Region *scratch;
+} Gym_Image_Ctx;
+
+static void gym__nn_image_grayscale_task(void *arg, size_t begin, size_t end, size_t worker)
 {
-    GYM_ASSERT(NN_INPUT(nn).cols >= 2);
-    GYM_ASSERT(NN_OUTPUT(nn).cols >= 1);
-    uint32_t *pixels_u32 = pixels;
-    for (size_t y = 0; y < height; ++y) {
+    Gym_Image_Ctx *ctx = arg;
+    NN nn = ctx->nn;
+    Region *r = &ctx->scratch[worker];
+    size_t width = ctx->width;
+    size_t n = (end - begin)*width;
+
+    size_t s = region_save(r);
+    Mat in = mat_alloc(r, n, nn.arch[0]);
+    Mat out = mat_alloc(r, n, nn.arch[nn.arch_count - 1]);
+    for (size_t y = begin; y < end; ++y) {
         for (size_t x = 0; x < width; ++x) {
-            ROW_AT(NN_INPUT(nn), 0) = (float)x/(float)(width - 1);
-            ROW_AT(NN_INPUT(nn), 1) = (float)y/(float)(height - 1);
-            nn_forward(nn);
-            float a = ROW_AT(NN_OUTPUT(nn), 0);
-            if (a < low) a = low;
-            if (a > high) a = high;
-            uint32_t pixel = (a + low)/(high - low)*255.f;
-            pixels_u32[y*stride + x] = (0xFF<<(8*3))|(pixel<<(8*2))|(pixel<<(8*1))|(pixel<<(8*0));
+            Row row = mat_row(in, (y - begin)*width + x);
+            row_copy(row, ctx->in);
+            ROW_AT(row, 0) = (float)x/(float)(width - 1);
+            ROW_AT(row, 1) = (float)y/(float)(ctx->height - 1);
         }
     }
+
+    nn_forward_batch(r, nn, in, out);
+
+    for (size_t y = begin; y < end; ++y) {
+        for (size_t x = 0; x < width; ++x) {
+            float a = MAT_AT(out, (y - begin)*width + x, 0);
+            if (a < ctx->low) a = ctx->low;
+            if (a > ctx->high) a = ctx->high;
+            uint32_t pixel = (a + ctx->low)/(ctx->high - ctx->low)*255.f;
+            ctx->pixels[y*ctx->stride + x] = (0xFF<<(8*3))|(pixel<<(8*2))|(pixel<<(8*1))|(pixel<<(8*0));
+        }
+    }
+    region_rewind(r, s);
+}
+
+// Scanlines are forwarded in tiles of about GYM_IMAGE_TILE_PIXELS pixels,
+// each worker with its own scratch big enough for one tile
+static size_t gym__image_tile_lines(size_t width)
+{
+    return (GYM_IMAGE_TILE_PIXELS + width - 1)/width;
+}
+
+static size_t gym__image_scratch_bytes(size_t *arch, size_t arch_count, size_t width)
+{
+    size_t width_nn = 0;
+    for (size_t l = 0; l < arch_count; ++l) {
+        if (width_nn < arch[l]) width_nn = arch[l];
+    }
+    size_t pixels = gym__image_tile_lines(width)*width;
+    return region_footprint(sizeof(float)*pixels*arch[0]) +
+           region_footprint(sizeof(float)*pixels*arch[arch_count - 1]) +
+           2*region_footprint(sizeof(float)*pixels*width_nn);
+}
+
+size_t gym_nn_image_grayscale_bytes(size_t *arch, size_t arch_count, size_t width)
+{
+    if (width == 0) return 0;
+    size_t workers = nn_threads_count();
+    return region_footprint(sizeof(Region)*workers) +
+           workers*region_sub_bytes(gym__image_scratch_bytes(arch, arch_count, width));
+}
+
+void gym_nn_image_grayscale(Region *r, NN nn, Row in, void *pixels, size_t width, size_t height, size_t stride, float low, float high)
+{
+    GYM_ASSERT(nn.arch[0] >= 2);
+    GYM_ASSERT(in.cols == nn.arch[0]);
+    if (width == 0) return;
+
+    size_t lines = gym__image_tile_lines(width);
+
+    size_t s = region_save(r);
+    size_t workers = nn_threads_count();
+    Gym_Image_Ctx ctx = {
+        .nn = nn,
+        .in = in,
+        .pixels = pixels,
+        .width = width,
+        .height = height,
+        .stride = stride,
+        .low = low,
+        .high = high,
+    };
+    ctx.scratch = region_alloc(r, sizeof(*ctx.scratch)*workers);
+    GYM_ASSERT(ctx.scratch != NULL);
+    for (size_t i = 0; i < workers; ++i) {
+        ctx.scratch[i] = region_sub(r, gym__image_scratch_bytes(nn.arch, nn.arch_count, width));
+    }
+
+    nn_parallel_for(0, height, lines, gym__nn_image_grayscale_task, &ctx);
+
+    region_rewind(r, s);
+}
+
+#ifdef NN_THREADS
+// Set in Gym_Trainer.middle when the snapshot there is newer than what the
+// UI has seen
+#define GYM__TRAINER_FRESH 4u
+
+struct Gym_Trainer {
+    NN nn;
+    Gym_Train_Step step;
+    void *arg;
+    // Each snapshot is owned by exactly one of the trainer (back), the UI
+    // (front) and the handoff between them (middle). Publishing swaps back
+    // with middle, taking a snapshot swaps front with middle.
+    NN snapshots[3];
+    size_t back;
+    size_t front;
+    atomic_uint middle;
+    bool unpublished;   // nn changed since the last publish
+    atomic_uint waiting; // The UI wants the lock
+    bool quit;
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+};
+
+static void gym__trainer_publish(Gym_Trainer *t)
+{
+    nn_copy(t->snapshots[t->back], t->nn);
+    t->back = atomic_exchange(&t->middle, t->back | GYM__TRAINER_FRESH) & ~GYM__TRAINER_FRESH;
+    t->unpublished = false;
+}
+
+static void *gym__trainer_thread(void *arg)
+{
+    Gym_Trainer *t = arg;
+    pthread_mutex_lock(&t->mutex);
+    while (!t->quit) {
+        if (atomic_load(&t->waiting) > 0) {
+            pthread_cond_wait(&t->cond, &t->mutex);
+            continue;
+        }
+        if (t->step(t->arg)) {
+            t->unpublished = true;
+            // Copying the parameters after every step would be wasted on
+            // snapshots the UI never gets to see, so the next one waits
+            // until the UI took the previous one
+            if (!(atomic_load(&t->middle) & GYM__TRAINER_FRESH)) gym__trainer_publish(t);
+        } else {
+            if (t->unpublished) gym__trainer_publish(t);
+            pthread_cond_wait(&t->cond, &t->mutex);
+        }
+    }
+    pthread_mutex_unlock(&t->mutex);
+    return NULL;
+}
+
+Gym_Trainer *gym_trainer_alloc(Region *r, NN nn, Gym_Train_Step step, void *arg)
+{
+    Gym_Trainer *t = region_alloc(r, sizeof(*t));
+    GYM_ASSERT(t != NULL);
+    memset(t, 0, sizeof(*t));
+    t->nn = nn;
+    t->step = step;
+    t->arg = arg;
+    for (size_t i = 0; i < 3; ++i) {
+        t->snapshots[i] = nn_alloc(r, nn.arch, nn.arch_count);
+        nn_copy(t->snapshots[i], nn);
+    }
+    t->front = 0;
+    atomic_init(&t->middle, 1);
+    t->back = 2;
+    atomic_init(&t->waiting, 0);
+
+    pthread_mutex_init(&t->mutex, NULL);
+    pthread_cond_init(&t->cond, NULL);
+    int ret = pthread_create(&t->thread, NULL, gym__trainer_thread, t);
+    GYM_ASSERT(ret == 0);
+    return t;
+}
+
+NN gym_trainer_snapshot(Gym_Trainer *t)
+{
+    if (atomic_load(&t->middle) & GYM__TRAINER_FRESH) {
+        t->front = atomic_exchange(&t->middle, t->front) & ~GYM__TRAINER_FRESH;
+    }
+    return t->snapshots[t->front];
+}
+
+void gym_trainer_lock(Gym_Trainer *t)
+{
+    // Without the flag the trainer would keep grabbing the mutex right back
+    // after every step and the UI could wait for many of them
+    atomic_fetch_add(&t->waiting, 1);
+    pthread_mutex_lock(&t->mutex);
+    atomic_fetch_sub(&t->waiting, 1);
+}
+
+void gym_trainer_unlock(Gym_Trainer *t, bool changed)
+{
+    if (changed) t->unpublished = true;
+    // Whatever the UI did to the state may be worth training on, e.g. unpausing
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+}
+
+void gym_trainer_free(Gym_Trainer *t)
+{
+    gym_trainer_lock(t);
+    t->quit = true;
+    gym_trainer_unlock(t, false);
+    pthread_join(t->thread, NULL);
+    pthread_cond_destroy(&t->cond);
+    pthread_mutex_destroy(&t->mutex);
+}
+#endif // NN_THREADS
+
+Gym_Budget gym_budget(double budget)
+{
+    Gym_Budget b = {
+        .budget = budget,
+        .report_start = GetTime(),
+    };
+    return b;
+}
+
+void gym_budget_begin(Gym_Budget *b)
+{
+    double now = GetTime();
+    if (now - b->report_start >= GYM_BUDGET_REPORT_SECS) {
+        b->samples_per_sec = b->samples/(now - b->report_start);
+        b->samples = 0;
+        b->report_start = now;
+    }
+    b->frame_start = now;
+    b->batches = 0;
+}
+
+bool gym_budget_next(Gym_Budget *b)
+{
+    double now = GetTime();
+    if (b->batches > 0 && now - b->frame_start + b->batch_secs > b->budget) return false;
+    b->batches += 1;
+    b->batch_start = now;
+    return true;
+}
+
+void gym_budget_done(Gym_Budget *b, size_t samples)
+{
+    double secs = GetTime() - b->batch_start;
+    // Quick enough to follow a change of the arch or the batch size within
+    // a frame or two, smooth enough to ignore a single preempted batch
+    b->batch_secs = b->batch_secs == 0 ? secs : b->batch_secs*0.9 + secs*0.1;
+    b->samples += samples;
 }
 
 Gym_Rect gym_rect(float x, float y, float w, float h)
@@ -26,11 +26,74 @@
 #define NN_MALLOC malloc
 #endif // NN_MALLOC
 
+#ifndef NN_FREE
+#include <stdlib.h>
+#define NN_FREE free
+#endif // NN_FREE
+
 #ifndef NN_ASSERT
 #include <assert.h>
 #define NN_ASSERT assert
 #endif // NN_ASSERT
 
+// The smallest amount of multiply-adds worth handing to another thread
+#ifndef NN_PARALLEL_MIN_WORK
+#define NN_PARALLEL_MIN_WORK (64*1024)
+#endif // NN_PARALLEL_MIN_WORK
+
+// nn_backprop() doesn't give a worker less rows than that, because
+// below it waking up the threads costs more than they save
+#ifndef NN_BACKPROP_MIN_ROWS
+#define NN_BACKPROP_MIN_ROWS 16
+#endif // NN_BACKPROP_MIN_ROWS
+
+// Define NN_NO_SIMD to always use the portable scalar kernels
+
+// Define NN_FAST_MATH to run sigmoid, tanh and sin over the rows with
+// vectorized approximations instead of libm. Leave it undefined for exact
+// results, e.g. when checking the gradients with nn_finite_diff().
+
+// Blocking of mat_dot. NN_GEMM_KC rows by NN_GEMM_NC columns of b are
+// expected to stay in L2 while all the rows of a are streamed through them
+#ifndef NN_GEMM_KC
+#define NN_GEMM_KC 256
+#endif // NN_GEMM_KC
+
+#ifndef NN_GEMM_NC
+#define NN_GEMM_NC 256
+#endif // NN_GEMM_NC
+
+// Alignment of every allocation of a Region in bytes. A power of two,
+// 64 makes them start on a cache line and fit any SIMD load.
+#ifndef NN_REGION_ALIGNMENT
+#define NN_REGION_ALIGNMENT 64
+#endif // NN_REGION_ALIGNMENT
+
+// The smallest block a Region chains once it runs out of memory
+#ifndef NN_REGION_MIN_BLOCK
+#define NN_REGION_MIN_BLOCK (1024*1024)
+#endif // NN_REGION_MIN_BLOCK
+
+// Size of the huge pages REGION_HUGEPAGES rounds the blocks up to
+#ifndef NN_HUGEPAGE_SIZE
+#define NN_HUGEPAGE_SIZE (2*1024*1024)
+#endif // NN_HUGEPAGE_SIZE
+
+// Alignment of NN.params in bytes
+#ifndef NN_PARAMS_ALIGNMENT
+#define NN_PARAMS_ALIGNMENT 64
+#endif // NN_PARAMS_ALIGNMENT
+
+// How many rows ahead mat_gather_rows() prefetches
+#ifndef NN_GATHER_PREFETCH
+#define NN_GATHER_PREFETCH 4
+#endif // NN_GATHER_PREFETCH
+
+// Width of the blocks of a transposed b that get packed on the stack
+#ifndef NN_GEMM_PACK_NC
+#define NN_GEMM_PACK_NC 64
+#endif // NN_GEMM_PACK_NC
+
 #define ARRAY_LEN(xs) sizeof((xs))/sizeof((xs)[0])
 
 typedef enum {
@@ -52,24 +115,54 @@ float actf(float x, Act act);
 // Derivative of the activation function based on its value
 float dactf(float y, Act act);
 
+// Applies an activation function to n consecutive floats in place
+typedef void (*Nn_Act_Row)(float *xs, size_t n);
+
+typedef enum {
+    // Fail (NN_ASSERT) when full instead of chaining another block
+    REGION_FIXED     = 1 << 0,
+    // Back the blocks with anonymous mmap instead of NN_MALLOC
+    REGION_MMAP      = 1 << 1,
+    // REGION_MMAP with MAP_HUGETLB, or with madvise(MADV_HUGEPAGE) if there
+    // are no huge pages reserved
+    REGION_HUGEPAGES = 1 << 2,
+} Region_Flags;
+
+typedef struct Region_Block Region_Block;
+
+// A bump allocator over a chain of blocks. Once a block is full the next
+// one is chained after it, so the allocations never move. Every allocation
+// is NN_REGION_ALIGNMENT aligned and takes region_footprint() bytes.
+// A zero initialized Region is valid and grows on the first allocation.
 typedef struct {
-    size_t capacity;
-    size_t size;
-    uintptr_t *words;
+    Region_Block *first;
+    Region_Block *current;
+    unsigned flags;
 } Region;
 
-// capacity is in bytes, but it can allocate more just to keep things
-// word aligned
+// capacity is in bytes, it is the size of the first block
 Region region_alloc_alloc(size_t capacity_bytes);
+Region region_alloc_alloc_flags(size_t capacity_bytes, unsigned flags);
+void region_free(Region *r);
 void *region_alloc(Region *r, size_t size_bytes);
-#define region_reset(r) (NN_ASSERT((r) != NULL), (r)->size = 0)
-#define region_occupied_bytes(r) (NN_ASSERT((r) != NULL), (r)->size*sizeof(*(r)->words))
-#define region_save(r) (NN_ASSERT((r) != NULL), (r)->size)
-#define region_rewind(r, s) (NN_ASSERT((r) != NULL), (r)->size = s)
+// How many bytes of a Region an allocation of size_bytes actually takes
+size_t region_footprint(size_t size_bytes);
+// Carves a separate fixed Region out of r, e.g. to give every worker its own scratch memory
+Region region_sub(Region *r, size_t capacity_bytes);
+// How many bytes of the parent Region region_sub() takes
+size_t region_sub_bytes(size_t capacity_bytes);
+void region_reset(Region *r);
+size_t region_occupied_bytes(const Region *r);
+// region_save() marks the current position, region_rewind() frees
+// everything allocated after it. The blocks chained in between are kept
+// around for the allocations to come.
+size_t region_save(const Region *r);
+void region_rewind(Region *r, size_t s);
 
 typedef struct {
     size_t rows;
     size_t cols;
+    size_t stride; // distance between the beginnings of two consecutive rows in floats, >= cols
     float *elements;
 } Mat;
 
@@ -88,18 +181,34 @@ Row row_slice(Row row, size_t i, size_t cols);
 #define row_print(row, name, padding) mat_print(row_as_mat(row), name, padding)
 #define row_copy(dst, src) mat_copy(row_as_mat(dst), row_as_mat(src))
 
-#define MAT_AT(m, i, j) (m).elements[(i)*(m).cols + (j)]
+#define MAT_AT(m, i, j) (m).elements[(i)*(m).stride + (j)]
 
 Mat mat_alloc(Region *r, size_t rows, size_t cols);
 void mat_fill(Mat m, float x);
 void mat_rand(Mat m, float low, float high);
 Row mat_row(Mat m, size_t row);
+// Views into a part of m. They share the elements with m and never copy.
+Mat mat_slice(Mat m, size_t row, size_t col, size_t rows, size_t cols);
+Mat mat_slice_rows(Mat m, size_t row, size_t rows);
+Mat mat_slice_cols(Mat m, size_t col, size_t cols);
 void mat_copy(Mat dst, Mat src);
+// dst = a*b. Cache-blocked and register-tiled, picks AVX2/FMA or SSE kernels at runtime
 void mat_dot(Mat dst, Mat a, Mat b);
+// Reference textbook implementation of mat_dot. Slow, but obviously correct
+void mat_dot_naive(Mat dst, Mat a, Mat b);
+// dst = a^T*b
+void mat_dot_at(Mat dst, Mat a, Mat b);
+// dst = a*b^T
+void mat_dot_bt(Mat dst, Mat a, Mat b);
+// dst = act(a*w + b) for every row of a in a single pass: the accumulators
+// start from the bias and the activation runs in the epilogue of the kernel
+void mat_dense(Mat dst, Mat a, Mat w, Row b, Act act);
 void mat_sum(Mat dst, Mat a);
 void mat_act(Mat m);
 void mat_print(Mat m, const char *name, size_t padding);
 void mat_shuffle_rows(Mat m);
+// dst row i = src row rows[i], for all the rows of dst
+void mat_gather_rows(Mat dst, Mat src, const size_t *rows);
 #define MAT_PRINT(m) mat_print(m, #m, 0)
 
 typedef struct {
@@ -108,8 +217,19 @@ typedef struct {
     Mat *ws; // The amount of activations is arch_count-1
     Row *bs; // The amount of activations is arch_count-1
 
-    // TODO: maybe remove these? It would be better to allocate them in a
-    // temporary region during the actual forwarding
+    // All the weights and biases in a single NN_PARAMS_ALIGNMENT aligned
+    // buffer laid out as ws[0], bs[0], ws[1], bs[1], ... ws and bs are just
+    // views into it, so anything that treats the parameters uniformly
+    // (learning, reductions, copies) is a single loop over params.
+    float *params;
+    size_t params_count;
+    // Size of the whole file when params point into the mapping of
+    // nn_load_mmap(), trailing sections included, and 0 otherwise
+    size_t mapped_size;
+
+    // Activations of nn_forward_activations(), one row per layer. They make
+    // the NN stateful, so only the visualizations go through them. nn_forward()
+    // and everything else only read the weights and the arch.
     Row *as;
 } NN;
 
@@ -117,31 +237,245 @@ typedef struct {
 #define NN_OUTPUT(nn) (NN_ASSERT((nn).arch_count > 0), (nn).as[(nn).arch_count-1])
 
 NN nn_alloc(Region *r, size_t *arch, size_t arch_count);
+// Amount of weights and biases of the architecture
+size_t nn_params_count(size_t *arch, size_t arch_count);
+// dst = src for all the parameters of two NNs of the same architecture
+void nn_copy(NN dst, NN src);
 void nn_zero(NN nn);
 void nn_print(NN nn, const char *name);
 #define NN_PRINT(nn) nn_print(nn, #nn);
 void nn_rand(NN nn, float low, float high);
-// TODO: make nn_forward signature more natural
-//
-// Something more like `Mat nn_forward(NN nn, Mat in)`
-void nn_forward(NN nn);
-float nn_cost(NN nn, Mat t);
+// Forwards every row of in and returns the outputs, allocated in r. The NN
+// is only read, so any amount of threads can share one as long as each of
+// them has its own r.
+Mat nn_forward(Region *r, NN nn, Mat in);
+// Forwards NN_INPUT(nn) into NN_OUTPUT(nn), keeping every activation in nn.as
+void nn_forward_activations(NN nn);
+// Forwards every row of `in` through nn into the corresponding row of `out`.
+// Each layer is a single mat_dense over the whole batch. The intermediate
+// activations live in r and are rewound before returning.
+void nn_forward_batch(Region *r, NN nn, Mat in, Mat out);
+float nn_cost(Region *r, NN nn, Mat t);
 NN nn_finite_diff(Region *r, NN nn, Mat t, float eps);
-NN nn_backprop(Region *r, NN nn, Mat t);
+// Gradient of the cost by every parameter of nn. If cost is not NULL it also
+// gets nn_cost(r, nn, t), computed from the same forward pass.
+NN nn_backprop(Region *r, NN nn, Mat t, float *cost);
+// Plain SGD step, see Optimizer for the rest
 void nn_learn(NN nn, NN g, float rate);
 
+// Immutable inference model, made out of a trained NN by nn_freeze(). The
+// arch and the parameters are copied into a single block and are never
+// written again, so a Model carries no activations or gradients, can be
+// shared by any amount of threads and stays shared between forked workers.
+// The weights keep the in x out layout of NN.params, which is already the
+// one the forward GEMM streams through.
+typedef struct {
+    Act act;
+    size_t arch_count;
+    const size_t *arch;
+    size_t params_count;
+    const float *params;
+} Model;
+
+Model nn_freeze(Region *r, NN nn);
+size_t nn_freeze_bytes(size_t *arch, size_t arch_count);
+// nn_forward() for a Model, it takes nn_forward_bytes() of r
+Mat model_forward(Region *r, Model m, Mat in);
+
+// Versioned binary model files: a header with NN_ACT and the arch, followed
+// by the parameters in the layout of NN.params, every section aligned to 64
+// bytes. Failures are reported to stderr and return false.
+bool nn_save(const char *file_path, NN nn);
+// Maps the file and points the weights and biases of *nn straight into the
+// mapping, so nothing is copied and the processes that load the same file
+// share its pages until one of them writes into the parameters. Only ws, bs,
+// as and the arch are allocated in r. Where there is no mmap the file is
+// read into r instead.
+bool nn_load_mmap(Region *r, const char *file_path, NN *nn);
+// Unmaps the whole file of an NN that came from nn_load_mmap(), including
+// the checkpoint sections after the parameters
+void nn_unload_mmap(NN nn);
+// Copies the parameters of the file into an existing nn of the same arch
+bool nn_load(const char *file_path, NN nn);
+
+// Define NN_THREADS to get a persistent work-stealing pool of pthreads that
+// nn_backprop(), mat_dot() and friends split their rows across. Without it
+// everything runs on the calling thread.
+typedef void (*Nn_Task)(void *arg, size_t worker);
+typedef void (*Nn_Range_Task)(void *arg, size_t begin, size_t end, size_t worker);
+
+// 0 (the default) means one worker per online CPU. Call it before the
+// pool is used by more than one thread.
+void nn_threads_set_count(size_t count);
+// Amount of workers in the pool, including the calling thread
+size_t nn_threads_count(void);
+// Runs task(arg, worker) for every worker of the pool and waits for all of them
+void nn_threads_run(Nn_Task task, void *arg);
+// Calls task(arg, b, e, worker) over [begin, end) in pieces of at most grain
+// iterations. Each worker starts with an equal share of the range and steals
+// half of the biggest share left once it runs out. If the pool is already
+// busy (e.g. nn_parallel_for inside of a task) the whole loop runs serially
+// on the calling thread as worker 0.
+void nn_parallel_for(size_t begin, size_t end, size_t grain, Nn_Range_Task task, void *arg);
+
+typedef enum {
+    OPT_SGD,
+    OPT_MOMENTUM,
+    OPT_RMSPROP,
+    OPT_ADAM,
+} Opt;
+
+// Updates the parameters of an NN by its gradients. The state of the
+// optimizer lives in flat buffers laid out exactly like NN.params, so a
+// step is a single fused pass over params, the gradient and the state.
+typedef struct {
+    Opt kind;
+    float rate;
+    float beta1; // decay of the velocity (OPT_MOMENTUM) or the first moment (OPT_ADAM)
+    float beta2; // decay of the second moment (OPT_RMSPROP, OPT_ADAM)
+    float eps;
+    size_t steps;
+    size_t count;
+    float *m;    // NULL for OPT_SGD and OPT_RMSPROP
+    float *v;    // NULL for OPT_SGD and OPT_MOMENTUM
+} Optimizer;
+
+// Comes with the usual defaults for everything except the rate. They can be
+// changed right in the returned struct.
+Optimizer optimizer_alloc(Region *r, NN nn, Opt kind, float rate);
+// Forgets the accumulated state, e.g. after the NN was re-randomized
+void optimizer_reset(Optimizer *opt);
+void optimizer_step(Optimizer *opt, NN nn, NN g);
+
+typedef struct Nn_Backprop_Scratch Nn_Backprop_Scratch;
+
+// Everything a training step needs besides the NN and the optimizer,
+// allocated once for an architecture and the biggest batch. The gradients,
+// deltas and activations of every worker stay in place between the steps,
+// so the steady-state training loop allocates nothing and keeps hitting the
+// same warm memory.
+//
+// The amount of workers is fixed at allocation, so nn_threads_set_count()
+// goes before workspace_alloc().
+typedef struct {
+    size_t *arch;
+    size_t arch_count;
+    size_t rows;     // The most rows of training data a single step takes
+    size_t workers;
+    NN *gs;          // Gradient of every worker, gs[0] is the result
+    float *costs;    // Sum of the squared errors of every worker
+    Nn_Backprop_Scratch *scratch;
+    Mat batch;       // rows x (input + output) for batch_process() to gather into
+} Workspace;
+
+Workspace workspace_alloc(Region *r, size_t *arch, size_t arch_count, size_t rows);
+// nn_backprop() into ws->gs[0]. t may have at most ws->rows rows.
+NN nn_backprop_ws(Workspace *ws, NN nn, Mat t, float *cost);
+
 typedef struct {
     size_t begin;
     float cost;
     bool finished;
+
+    // Optional order of the rows of the training data. With it
+    // batch_process() gathers every batch into a contiguous Mat and the
+    // training data stays read-only. Without it the batches are just views
+    // of consecutive rows.
+    size_t *order;
+    size_t order_count;
+    // State of the generator batch_shuffle() draws from, so that a
+    // checkpoint can resume the exact same sequence of shuffles
+    uint64_t rng;
 } Batch;
 
-void batch_process(Region *r, Batch *b, size_t batch_size, NN nn, Mat t, float rate);
+// Sets up b->order as the identity permutation of rows_count rows and seeds
+// b->rng from rand()
+void batch_order_alloc(Region *r, Batch *b, size_t rows_count);
+// Shuffles b->order, which is what mat_shuffle_rows(t) used to be for
+// between the epochs, without moving the rows themselves
+void batch_shuffle(Batch *b);
+// One step over the next ws->rows rows of t
+void batch_process(Workspace *ws, Batch *b, NN nn, Mat t, Optimizer *opt);
+
+// Periodic checkpoints that don't stall the training. checkpoint_save() only
+// copies the training state into one of two snapshots: the parameters, the
+// optimizer, the Batch with its order and generator, and the epoch. A writer
+// thread (the calling thread without NN_THREADS) then writes it to
+// <prefix>-<n>.nn in the nn_save() format followed by the rest of the state,
+// fsyncs it, renames it into place and deletes all but the keep newest
+// checkpoints. If the writer is still busy with the previous snapshot, a
+// newer one replaces the snapshot that is still waiting.
+typedef struct Checkpoint Checkpoint;
+
+// opt and b may be NULL, then that part of the state is not saved
+Checkpoint *checkpoint_alloc(Region *r, const char *prefix, size_t keep, NN nn, const Optimizer *opt, const Batch *b);
+void checkpoint_save(Checkpoint *cp, NN nn, const Optimizer *opt, const Batch *b, size_t epoch);
+typedef enum {
+    // There is no <prefix>-<n>.nn, the training starts from scratch
+    CHECKPOINT_NONE,
+    CHECKPOINT_RESUMED,
+    // There are checkpoints but none of them loads (a different arch or
+    // optimizer, or corruption). The training state is left alone.
+    CHECKPOINT_FAILED,
+} Checkpoint_Resume;
+
+// Loads the newest <prefix>-<n>.nn back into nn, *opt, *b and *epoch, so the
+// training continues exactly where that checkpoint was taken. Whenever there
+// are checkpoints, even ones that don't load, the following checkpoints
+// continue their numbering, so the existing files are never mistaken for
+// newer ones than what gets saved next.
+Checkpoint_Resume checkpoint_resume(Checkpoint *cp, NN nn, Optimizer *opt, Batch *b, size_t *epoch);
+// Waits for the last snapshot to be written and stops the writer
+void checkpoint_free(Checkpoint *cp);
+// Loads a single checkpoint. nn must have the arch of the file, and opt and
+// b must match the optimizer and the amount of rows it was saved with. Any
+// of opt, b and epoch may be NULL to skip that part of the state.
+bool checkpoint_load(const char *file_path, NN nn, Optimizer *opt, Batch *b, size_t *epoch);
+
+// Memory planning. These report exactly how many bytes of a Region the
+// corresponding functions take, provided the Region has them in a single
+// block, e.g. a Region created with region_alloc_alloc() of the planned size
+// right away. Such a Region never fails or grows in the middle of training.
+//
+// The functions that only need temporary memory give it back before they
+// return, so for them the peak is reported. The ones that depend on the
+// amount of workers assume the current nn_threads_count().
+size_t nn_alloc_bytes(size_t *arch, size_t arch_count);
+size_t optimizer_alloc_bytes(size_t *arch, size_t arch_count, Opt kind);
+size_t batch_order_alloc_bytes(size_t rows_count);
+size_t nn_forward_batch_bytes(size_t *arch, size_t arch_count, size_t rows);
+// Includes the returned outputs, which stay allocated
+size_t nn_forward_bytes(size_t *arch, size_t arch_count, size_t rows);
+size_t nn_cost_bytes(size_t *arch, size_t arch_count, size_t rows);
+// Includes the returned gradient, which stays allocated
+size_t nn_backprop_bytes(size_t *arch, size_t arch_count, size_t rows);
+size_t workspace_alloc_bytes(size_t *arch, size_t arch_count, size_t rows);
 
 #endif // NN_H_
 
 #ifdef NN_IMPLEMENTATION
 
+#ifdef NN_THREADS
+#include <pthread.h>
+#include <unistd.h>
+#endif // NN_THREADS
+
+#if !defined(NN_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define NN_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+#define NN_REGION_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+#include <errno.h>
+
 float sigmoidf(float x)
 {
     return 1.f / (1.f + expf(-x));
@@ -152,11 +486,10 @@ float reluf(float x)
     return x > 0 ? x : x*NN_RELU_PARAM;
 }
 
+// Only one expf() and no inf/inf for big |x|
 float tanhf(float x)
 {
-    float ex = expf(x);
-    float enx = expf(-x);
-    return (ex - enx)/(ex + enx);
+    return 1.f - 2.f/(expf(2.f*x) + 1.f);
 }
 
 float actf(float x, Act act)
@@ -177,12 +510,356 @@ float dactf(float y, Act act)
     case ACT_SIG:  return y*(1 - y);
     case ACT_RELU: return y >= 0 ? 1 : NN_RELU_PARAM;
     case ACT_TANH: return 1 - y*y;
-    case ACT_SIN:  return cosf(asinf(y));
+    // cos(asin(y)) without the trip through libm
+    case ACT_SIN:  return sqrtf(fmaxf(1 - y*y, 0));
     }
     NN_ASSERT(0 && "Unreachable");
     return 0.0f;
 }
 
+// Approximations behind the NN_FAST_MATH row kernels. The vector kernels
+// below evaluate the same formulas 8 floats at a time.
+//
+// expf: x = n*ln2 + r with |r| <= ln2/2, e^r by a degree 7 polynomial and
+// 2^n straight into the exponent bits. A couple of ulp off libm. x is
+// clamped to [-126*ln2, 127*ln2], so n rounds to at most 127 and 2^n stays
+// a normal float. Past the clamp the result saturates at about 2^127
+// instead of growing into inf. NaN goes through, so that a diverging model
+// still shows up as one.
+#define NN_EXP_MAX   88.0296919311130f
+#define NN_EXP_MIN  -87.3365447504019f
+#define NN_LOG2E     1.44269504088896341f
+#define NN_LN2_HI    0.693359375f
+#define NN_LN2_LO   -2.12194440e-4f
+#define NN_EXP_P0    1.9875691500e-4f
+#define NN_EXP_P1    1.3981999507e-3f
+#define NN_EXP_P2    8.3334519073e-3f
+#define NN_EXP_P3    4.1665795894e-2f
+#define NN_EXP_P4    1.6666665459e-1f
+#define NN_EXP_P5    5.0000001201e-1f
+
+// sinf: x = k*pi + r with |r| <= pi/2, sin(x) = (-1)^k*sin(r) and sin(r)
+// by its Taylor series up to r^11 (< 1e-7 off on the whole interval). pi is
+// split in three so k*pi is exact for |x| up to a few thousands. Past
+// NN_SIN_MAX (and for inf and NaN) the reduction would be too far off, so
+// those go to sinf() instead.
+#define NN_SIN_MAX   8192.f
+#define NN_INV_PI    0.318309886183790671f
+#define NN_PI_A      3.140625f
+#define NN_PI_B      9.67502593994140625e-4f
+#define NN_PI_C      1.509957990978376432e-7f
+#define NN_SIN_C3   -1.66666666666666667e-1f
+#define NN_SIN_C5    8.33333333333333333e-3f
+#define NN_SIN_C7   -1.98412698412698413e-4f
+#define NN_SIN_C9    2.75573192239858907e-6f
+#define NN_SIN_C11  -2.50521083854417188e-8f
+
+// Round to nearest without a call to libm. The callers clamp or check x first,
+// as the cast is undefined from |x| >= 2^31 on.
+static inline float nn__roundf(float x)
+{
+    return (float)(int32_t)(x + copysignf(0.5f, x));
+}
+
+static inline float nn__fast_expf(float x)
+{
+    if (x != x) return x;
+    x = x < NN_EXP_MIN ? NN_EXP_MIN : x;
+    x = x > NN_EXP_MAX ? NN_EXP_MAX : x;
+    float n = nn__roundf(x*NN_LOG2E);
+    x -= n*NN_LN2_HI;
+    x -= n*NN_LN2_LO;
+    float y = NN_EXP_P0;
+    y = y*x + NN_EXP_P1;
+    y = y*x + NN_EXP_P2;
+    y = y*x + NN_EXP_P3;
+    y = y*x + NN_EXP_P4;
+    y = y*x + NN_EXP_P5;
+    y = y*x*x + x + 1.f;
+    uint32_t bits = (uint32_t)((int32_t)n + 127) << 23;
+    float scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return y*scale;
+}
+
+static inline float nn__fast_sigmoidf(float x)
+{
+    return 1.f/(1.f + nn__fast_expf(-x));
+}
+
+static inline float nn__fast_tanhf(float x)
+{
+    return 1.f - 2.f/(nn__fast_expf(2.f*x) + 1.f);
+}
+
+static inline float nn__fast_sinf(float x)
+{
+    if (!(fabsf(x) <= NN_SIN_MAX)) return sinf(x);
+    float k = nn__roundf(x*NN_INV_PI);
+    float r = x - k*NN_PI_A;
+    r -= k*NN_PI_B;
+    r -= k*NN_PI_C;
+    float r2 = r*r;
+    float p = NN_SIN_C11;
+    p = p*r2 + NN_SIN_C9;
+    p = p*r2 + NN_SIN_C7;
+    p = p*r2 + NN_SIN_C5;
+    p = p*r2 + NN_SIN_C3;
+    float s = r + r*r2*p;
+    return ((int32_t)k & 1) ? -s : s;
+}
+
+#ifdef NN_FAST_MATH
+#define NN_ROW_SIGMOIDF nn__fast_sigmoidf
+#define NN_ROW_TANHF    nn__fast_tanhf
+#define NN_ROW_SINF     nn__fast_sinf
+#else
+#define NN_ROW_SIGMOIDF sigmoidf
+#define NN_ROW_TANHF    tanhf
+#define NN_ROW_SINF     sinf
+#endif // NN_FAST_MATH
+
+// Row-wise variants of actf. Each one is specialized for a single Act, so
+// the hot loops don't branch on the activation.
+static void nn__act_row_sig(float *xs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) xs[i] = NN_ROW_SIGMOIDF(xs[i]);
+}
+
+static void nn__act_row_relu(float *xs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) xs[i] = reluf(xs[i]);
+}
+
+static void nn__act_row_tanh(float *xs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) xs[i] = NN_ROW_TANHF(xs[i]);
+}
+
+static void nn__act_row_sin(float *xs, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) xs[i] = NN_ROW_SINF(xs[i]);
+}
+
+// Row-wise variants of dactf: ds[i] *= s*dactf(ys[i])
+typedef void (*Nn_Dact_Row)(float *ds, const float *ys, size_t n, float s);
+
+static void nn__dact_row_sig(float *ds, const float *ys, size_t n, float s)
+{
+    for (size_t i = 0; i < n; ++i) ds[i] *= s*ys[i]*(1 - ys[i]);
+}
+
+static void nn__dact_row_relu(float *ds, const float *ys, size_t n, float s)
+{
+    for (size_t i = 0; i < n; ++i) ds[i] *= s*(ys[i] >= 0 ? 1 : NN_RELU_PARAM);
+}
+
+static void nn__dact_row_tanh(float *ds, const float *ys, size_t n, float s)
+{
+    for (size_t i = 0; i < n; ++i) ds[i] *= s*(1 - ys[i]*ys[i]);
+}
+
+static void nn__dact_row_sin(float *ds, const float *ys, size_t n, float s)
+{
+    for (size_t i = 0; i < n; ++i) {
+        float c = 1 - ys[i]*ys[i];
+        ds[i] *= s*sqrtf(c > 0 ? c : 0);
+    }
+}
+
+#ifdef NN_SIMD_X86
+static bool nn__has_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+// Mask of the first n (< 8) lanes for the tails of the rows
+__attribute__((target("avx2,fma"), always_inline))
+static inline __m256i nn__mask8_avx2(size_t n)
+{
+    const __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    return _mm256_cmpgt_epi32(_mm256_set1_epi32((int)n), iota);
+}
+
+#ifdef NN_FAST_MATH
+__attribute__((target("avx2,fma"), always_inline))
+static inline __m256 nn__exp8_avx2(__m256 x)
+{
+    // min and max return their second operand for NaN, which keeps it NaN
+    x = _mm256_min_ps(_mm256_set1_ps(NN_EXP_MAX), _mm256_max_ps(_mm256_set1_ps(NN_EXP_MIN), x));
+    __m256 n = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(NN_LOG2E)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(NN_LN2_HI), x);
+    x = _mm256_fnmadd_ps(n, _mm256_set1_ps(NN_LN2_LO), x);
+    __m256 y = _mm256_set1_ps(NN_EXP_P0);
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P1));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P2));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P3));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P4));
+    y = _mm256_fmadd_ps(y, x, _mm256_set1_ps(NN_EXP_P5));
+    y = _mm256_fmadd_ps(_mm256_mul_ps(y, x), x, _mm256_add_ps(x, _mm256_set1_ps(1.f)));
+    __m256i bits = _mm256_slli_epi32(_mm256_add_epi32(_mm256_cvtps_epi32(n), _mm256_set1_epi32(127)), 23);
+    return _mm256_mul_ps(y, _mm256_castsi256_ps(bits));
+}
+
+__attribute__((target("avx2,fma"), always_inline))
+static inline __m256 nn__sin8_avx2(__m256 x)
+{
+    __m256 k = _mm256_round_ps(_mm256_mul_ps(x, _mm256_set1_ps(NN_INV_PI)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256 r = _mm256_fnmadd_ps(k, _mm256_set1_ps(NN_PI_A), x);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(NN_PI_B), r);
+    r = _mm256_fnmadd_ps(k, _mm256_set1_ps(NN_PI_C), r);
+    __m256 r2 = _mm256_mul_ps(r, r);
+    __m256 p = _mm256_set1_ps(NN_SIN_C11);
+    p = _mm256_fmadd_ps(p, r2, _mm256_set1_ps(NN_SIN_C9));
+    p = _mm256_fmadd_ps(p, r2, _mm256_set1_ps(NN_SIN_C7));
+    p = _mm256_fmadd_ps(p, r2, _mm256_set1_ps(NN_SIN_C5));
+    p = _mm256_fmadd_ps(p, r2, _mm256_set1_ps(NN_SIN_C3));
+    __m256 s = _mm256_fmadd_ps(_mm256_mul_ps(r, r2), p, r);
+    __m256i sign = _mm256_slli_epi32(_mm256_cvtps_epi32(k), 31);
+    s = _mm256_xor_ps(s, _mm256_castsi256_ps(sign));
+
+    __m256 abs_x = _mm256_andnot_ps(_mm256_set1_ps(-0.f), x);
+    int far = _mm256_movemask_ps(_mm256_cmp_ps(abs_x, _mm256_set1_ps(NN_SIN_MAX), _CMP_NLE_UQ));
+    if (far) {
+        float xs[8], ys[8];
+        _mm256_storeu_ps(xs, x);
+        _mm256_storeu_ps(ys, s);
+        for (size_t i = 0; i < 8; ++i) {
+            if (far & (1 << i)) ys[i] = sinf(xs[i]);
+        }
+        s = _mm256_loadu_ps(ys);
+    }
+    return s;
+}
+
+// act is always a compile time constant after inlining
+__attribute__((target("avx2,fma"), always_inline))
+static inline __m256 nn__act8_avx2(const Act act, __m256 x)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    const __m256 two = _mm256_set1_ps(2.f);
+    switch (act) {
+    case ACT_SIG:
+        return _mm256_div_ps(one, _mm256_add_ps(one, nn__exp8_avx2(_mm256_sub_ps(_mm256_setzero_ps(), x))));
+    case ACT_RELU: {
+        __m256 pos = _mm256_cmp_ps(x, _mm256_setzero_ps(), _CMP_GT_OQ);
+        return _mm256_blendv_ps(_mm256_mul_ps(x, _mm256_set1_ps(NN_RELU_PARAM)), x, pos);
+    }
+    case ACT_TANH:
+        return _mm256_sub_ps(one, _mm256_div_ps(two, _mm256_add_ps(nn__exp8_avx2(_mm256_mul_ps(two, x)), one)));
+    case ACT_SIN:
+        return nn__sin8_avx2(x);
+    }
+    return x;
+}
+
+__attribute__((target("avx2,fma"), always_inline))
+static inline void nn__act_rows_avx2(const Act act, float *xs, size_t n)
+{
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_ps(&xs[i], nn__act8_avx2(act, _mm256_loadu_ps(&xs[i])));
+    }
+    if (i < n) {
+        __m256i mask = nn__mask8_avx2(n - i);
+        _mm256_maskstore_ps(&xs[i], mask, nn__act8_avx2(act, _mm256_maskload_ps(&xs[i], mask)));
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void nn__act_row_sig_avx2(float *xs, size_t n)  { nn__act_rows_avx2(ACT_SIG, xs, n); }
+__attribute__((target("avx2,fma"))) static void nn__act_row_tanh_avx2(float *xs, size_t n) { nn__act_rows_avx2(ACT_TANH, xs, n); }
+__attribute__((target("avx2,fma"))) static void nn__act_row_sin_avx2(float *xs, size_t n)  { nn__act_rows_avx2(ACT_SIN, xs, n); }
+#endif // NN_FAST_MATH
+
+__attribute__((target("avx2,fma"), always_inline))
+static inline __m256 nn__dact8_avx2(const Act act, __m256 y)
+{
+    const __m256 one = _mm256_set1_ps(1.f);
+    switch (act) {
+    case ACT_SIG:
+        return _mm256_mul_ps(y, _mm256_sub_ps(one, y));
+    case ACT_RELU: {
+        __m256 pos = _mm256_cmp_ps(y, _mm256_setzero_ps(), _CMP_GE_OQ);
+        return _mm256_blendv_ps(_mm256_set1_ps(NN_RELU_PARAM), one, pos);
+    }
+    case ACT_TANH:
+        return _mm256_fnmadd_ps(y, y, one);
+    case ACT_SIN:
+        return _mm256_sqrt_ps(_mm256_max_ps(_mm256_fnmadd_ps(y, y, one), _mm256_setzero_ps()));
+    }
+    return one;
+}
+
+__attribute__((target("avx2,fma"), always_inline))
+static inline void nn__dact_rows_avx2(const Act act, float *ds, const float *ys, size_t n, float s)
+{
+    const __m256 vs = _mm256_set1_ps(s);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256 d = _mm256_mul_ps(_mm256_loadu_ps(&ds[i]), vs);
+        _mm256_storeu_ps(&ds[i], _mm256_mul_ps(d, nn__dact8_avx2(act, _mm256_loadu_ps(&ys[i]))));
+    }
+    if (i < n) {
+        __m256i mask = nn__mask8_avx2(n - i);
+        __m256 d = _mm256_mul_ps(_mm256_maskload_ps(&ds[i], mask), vs);
+        _mm256_maskstore_ps(&ds[i], mask, _mm256_mul_ps(d, nn__dact8_avx2(act, _mm256_maskload_ps(&ys[i], mask))));
+    }
+}
+
+__attribute__((target("avx2,fma"))) static void nn__dact_row_sig_avx2(float *ds, const float *ys, size_t n, float s)  { nn__dact_rows_avx2(ACT_SIG, ds, ys, n, s); }
+__attribute__((target("avx2,fma"))) static void nn__dact_row_relu_avx2(float *ds, const float *ys, size_t n, float s) { nn__dact_rows_avx2(ACT_RELU, ds, ys, n, s); }
+__attribute__((target("avx2,fma"))) static void nn__dact_row_tanh_avx2(float *ds, const float *ys, size_t n, float s) { nn__dact_rows_avx2(ACT_TANH, ds, ys, n, s); }
+__attribute__((target("avx2,fma"))) static void nn__dact_row_sin_avx2(float *ds, const float *ys, size_t n, float s)  { nn__dact_rows_avx2(ACT_SIN, ds, ys, n, s); }
+#endif // NN_SIMD_X86
+
+// The vectorized forward kernels are approximations, so they are only
+// picked with NN_FAST_MATH. Plain ReLU vectorizes fine on its own.
+static Nn_Act_Row nn__act_row(Act act)
+{
+#if defined(NN_SIMD_X86) && defined(NN_FAST_MATH)
+    if (nn__has_avx2()) {
+        switch (act) {
+        case ACT_SIG:  return nn__act_row_sig_avx2;
+        case ACT_RELU: return nn__act_row_relu;
+        case ACT_TANH: return nn__act_row_tanh_avx2;
+        case ACT_SIN:  return nn__act_row_sin_avx2;
+        }
+    }
+#endif // NN_SIMD_X86 && NN_FAST_MATH
+    switch (act) {
+    case ACT_SIG:  return nn__act_row_sig;
+    case ACT_RELU: return nn__act_row_relu;
+    case ACT_TANH: return nn__act_row_tanh;
+    case ACT_SIN:  return nn__act_row_sin;
+    }
+    NN_ASSERT(0 && "Unreachable");
+    return NULL;
+}
+
+// The derivatives are exact either way
+static Nn_Dact_Row nn__dact_row(Act act)
+{
+#ifdef NN_SIMD_X86
+    if (nn__has_avx2()) {
+        switch (act) {
+        case ACT_SIG:  return nn__dact_row_sig_avx2;
+        case ACT_RELU: return nn__dact_row_relu_avx2;
+        case ACT_TANH: return nn__dact_row_tanh_avx2;
+        case ACT_SIN:  return nn__dact_row_sin_avx2;
+        }
+    }
+#endif // NN_SIMD_X86
+    switch (act) {
+    case ACT_SIG:  return nn__dact_row_sig;
+    case ACT_RELU: return nn__dact_row_relu;
+    case ACT_TANH: return nn__dact_row_tanh;
+    case ACT_SIN:  return nn__dact_row_sin;
+    }
+    NN_ASSERT(0 && "Unreachable");
+    return NULL;
+}
+
 float rand_float(void)
 {
     return (float) rand() / (float) RAND_MAX;
@@ -193,12 +870,418 @@ Mat mat_alloc(Region *r, size_t rows, size_t cols)
     Mat m;
     m.rows = rows;
     m.cols = cols;
+    m.stride = cols;
     m.elements = region_alloc(r, sizeof(*m.elements)*rows*cols);
     NN_ASSERT(m.elements != NULL);
     return m;
 }
 
+// The kernels below compute C = act(A*B + bias) (or C += A*B) on raw pointers:
+//   A is m x k, element (i, p) is at a[i*a_rs + p*a_cs], so a transposed A is just a different pair of strides
+//   B is k x n, rows are ldb floats apart, columns are contiguous
+//   C is m x n, rows are ldc floats apart, columns are contiguous
+//   bias is either NULL or n floats the accumulators start from instead of zeros
+//   act is either NULL or applied to the rows of C in the epilogue, while they are still in L1
+typedef void (*Nn_Gemm_Block)(size_t m, size_t n, size_t k,
+                              const float *a, size_t a_rs, size_t a_cs,
+                              const float *b, size_t ldb,
+                              float *c, size_t ldc,
+                              const float *bias, bool accumulate, Nn_Act_Row act);
+
+static void nn__gemm_block_scalar(size_t m, size_t n, size_t k,
+                                  const float *a, size_t a_rs, size_t a_cs,
+                                  const float *b, size_t ldb,
+                                  float *c, size_t ldc,
+                                  const float *bias, bool accumulate, Nn_Act_Row act)
+{
+    for (size_t i = 0; i < m; ++i) {
+        float *ci = &c[i*ldc];
+        if (!accumulate) {
+            if (bias) memcpy(ci, bias, sizeof(*ci)*n);
+            else      memset(ci, 0, sizeof(*ci)*n);
+        }
+        for (size_t p = 0; p < k; ++p) {
+            float ap = a[i*a_rs + p*a_cs];
+            const float *bp = &b[p*ldb];
+            for (size_t j = 0; j < n; ++j) {
+                ci[j] += ap*bp[j];
+            }
+        }
+        if (act) act(ci, n);
+    }
+}
+
+#ifdef NN_SIMD_X86
+
+#define NN_GEMM_AVX2_MR 4
+#define NN_GEMM_AVX2_NR 16
+
+// Computes an MR x nr tile of C keeping it in 2*MR ymm accumulators for the
+// whole k loop. MR and full are always compile time constants after inlining.
+__attribute__((target("avx2,fma"), always_inline))
+static inline void nn__gemm_tile_avx2(const size_t MR, const bool full, size_t nr, size_t k,
+                                      const float *a, size_t a_rs, size_t a_cs,
+                                      const float *b, size_t ldb,
+                                      float *c, size_t ldc,
+                                      const float *bias, bool accumulate)
+{
+    const __m256i iota = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i mask0 = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)nr), iota);
+    const __m256i mask1 = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)nr - 8), iota);
+
+    __m256 init0 = _mm256_setzero_ps();
+    __m256 init1 = _mm256_setzero_ps();
+    if (!accumulate && bias) {
+        init0 = full ? _mm256_loadu_ps(bias)     : _mm256_maskload_ps(bias, mask0);
+        init1 = full ? _mm256_loadu_ps(bias + 8) : _mm256_maskload_ps(bias + 8, mask1);
+    }
+
+    __m256 acc[NN_GEMM_AVX2_MR][2];
+    for (size_t r = 0; r < MR; ++r) {
+        if (!accumulate) {
+            acc[r][0] = init0;
+            acc[r][1] = init1;
+        } else if (full) {
+            acc[r][0] = _mm256_loadu_ps(&c[r*ldc]);
+            acc[r][1] = _mm256_loadu_ps(&c[r*ldc + 8]);
+        } else {
+            acc[r][0] = _mm256_maskload_ps(&c[r*ldc], mask0);
+            acc[r][1] = _mm256_maskload_ps(&c[r*ldc + 8], mask1);
+        }
+    }
+
+    for (size_t p = 0; p < k; ++p) {
+        const float *bp = &b[p*ldb];
+        __m256 b0 = full ? _mm256_loadu_ps(bp)     : _mm256_maskload_ps(bp, mask0);
+        __m256 b1 = full ? _mm256_loadu_ps(bp + 8) : _mm256_maskload_ps(bp + 8, mask1);
+        for (size_t r = 0; r < MR; ++r) {
+            __m256 ar = _mm256_broadcast_ss(&a[r*a_rs + p*a_cs]);
+            acc[r][0] = _mm256_fmadd_ps(ar, b0, acc[r][0]);
+            acc[r][1] = _mm256_fmadd_ps(ar, b1, acc[r][1]);
+        }
+    }
+
+    for (size_t r = 0; r < MR; ++r) {
+        if (full) {
+            _mm256_storeu_ps(&c[r*ldc], acc[r][0]);
+            _mm256_storeu_ps(&c[r*ldc + 8], acc[r][1]);
+        } else {
+            _mm256_maskstore_ps(&c[r*ldc], mask0, acc[r][0]);
+            _mm256_maskstore_ps(&c[r*ldc + 8], mask1, acc[r][1]);
+        }
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void nn__gemm_block_avx2(size_t m, size_t n, size_t k,
+                                const float *a, size_t a_rs, size_t a_cs,
+                                const float *b, size_t ldb,
+                                float *c, size_t ldc,
+                                const float *bias, bool accumulate, Nn_Act_Row act)
+{
+    const size_t MR = NN_GEMM_AVX2_MR;
+    const size_t NR = NN_GEMM_AVX2_NR;
+    for (size_t i = 0; i < m; i += MR) {
+        size_t mr = m - i < MR ? m - i : MR;
+        const float *ai = &a[i*a_rs];
+        float *ci = &c[i*ldc];
+        for (size_t j = 0; j < n; j += NR) {
+            size_t nr = n - j < NR ? n - j : NR;
+            bool full = nr == NR;
+            const float *bj = bias ? &bias[j] : NULL;
+#define NN__TILE(MR_, full_) nn__gemm_tile_avx2(MR_, full_, nr, k, ai, a_rs, a_cs, &b[j], ldb, &ci[j], ldc, bj, accumulate)
+            switch (mr) {
+            case 4: if (full) NN__TILE(4, true); else NN__TILE(4, false); break;
+            case 3: if (full) NN__TILE(3, true); else NN__TILE(3, false); break;
+            case 2: if (full) NN__TILE(2, true); else NN__TILE(2, false); break;
+            case 1: if (full) NN__TILE(1, true); else NN__TILE(1, false); break;
+            }
+#undef NN__TILE
+        }
+        if (act) {
+            for (size_t r = 0; r < mr; ++r) act(&ci[r*ldc], n);
+        }
+    }
+}
+
+#define NN_GEMM_SSE_MR 4
+#define NN_GEMM_SSE_NR 8
+
+__attribute__((target("sse2"), always_inline))
+static inline void nn__gemm_tile_sse(const size_t MR, size_t k,
+                                     const float *a, size_t a_rs, size_t a_cs,
+                                     const float *b, size_t ldb,
+                                     float *c, size_t ldc,
+                                     const float *bias, bool accumulate)
+{
+    __m128 init0 = _mm_setzero_ps();
+    __m128 init1 = _mm_setzero_ps();
+    if (!accumulate && bias) {
+        init0 = _mm_loadu_ps(bias);
+        init1 = _mm_loadu_ps(bias + 4);
+    }
+
+    __m128 acc[NN_GEMM_SSE_MR][2];
+    for (size_t r = 0; r < MR; ++r) {
+        if (accumulate) {
+            acc[r][0] = _mm_loadu_ps(&c[r*ldc]);
+            acc[r][1] = _mm_loadu_ps(&c[r*ldc + 4]);
+        } else {
+            acc[r][0] = init0;
+            acc[r][1] = init1;
+        }
+    }
+
+    for (size_t p = 0; p < k; ++p) {
+        const float *bp = &b[p*ldb];
+        __m128 b0 = _mm_loadu_ps(bp);
+        __m128 b1 = _mm_loadu_ps(bp + 4);
+        for (size_t r = 0; r < MR; ++r) {
+            __m128 ar = _mm_set1_ps(a[r*a_rs + p*a_cs]);
+            acc[r][0] = _mm_add_ps(acc[r][0], _mm_mul_ps(ar, b0));
+            acc[r][1] = _mm_add_ps(acc[r][1], _mm_mul_ps(ar, b1));
+        }
+    }
+
+    for (size_t r = 0; r < MR; ++r) {
+        _mm_storeu_ps(&c[r*ldc], acc[r][0]);
+        _mm_storeu_ps(&c[r*ldc + 4], acc[r][1]);
+    }
+}
+
+__attribute__((target("sse2")))
+static void nn__gemm_block_sse(size_t m, size_t n, size_t k,
+                               const float *a, size_t a_rs, size_t a_cs,
+                               const float *b, size_t ldb,
+                               float *c, size_t ldc,
+                               const float *bias, bool accumulate, Nn_Act_Row act)
+{
+    const size_t MR = NN_GEMM_SSE_MR;
+    const size_t NR = NN_GEMM_SSE_NR;
+    size_t n_full = n/NR*NR;
+    for (size_t i = 0; i < m; i += MR) {
+        size_t mr = m - i < MR ? m - i : MR;
+        const float *ai = &a[i*a_rs];
+        float *ci = &c[i*ldc];
+        for (size_t j = 0; j < n_full; j += NR) {
+            const float *bj = bias ? &bias[j] : NULL;
+            switch (mr) {
+            case 4: nn__gemm_tile_sse(4, k, ai, a_rs, a_cs, &b[j], ldb, &ci[j], ldc, bj, accumulate); break;
+            case 3: nn__gemm_tile_sse(3, k, ai, a_rs, a_cs, &b[j], ldb, &ci[j], ldc, bj, accumulate); break;
+            case 2: nn__gemm_tile_sse(2, k, ai, a_rs, a_cs, &b[j], ldb, &ci[j], ldc, bj, accumulate); break;
+            case 1: nn__gemm_tile_sse(1, k, ai, a_rs, a_cs, &b[j], ldb, &ci[j], ldc, bj, accumulate); break;
+            }
+        }
+        if (n_full < n) {
+            nn__gemm_block_scalar(mr, n - n_full, k, ai, a_rs, a_cs, &b[n_full], ldb, &ci[n_full], ldc,
+                                  bias ? &bias[n_full] : NULL, accumulate, NULL);
+        }
+        if (act) {
+            for (size_t r = 0; r < mr; ++r) act(&ci[r*ldc], n);
+        }
+    }
+}
+#endif // NN_SIMD_X86
+
+static Nn_Gemm_Block nn__gemm_block = NULL;
+
+static void nn__gemm_pick(void)
+{
+#ifdef NN_SIMD_X86
+    if (nn__has_avx2()) {
+        nn__gemm_block = nn__gemm_block_avx2;
+        return;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        nn__gemm_block = nn__gemm_block_sse;
+        return;
+    }
+#endif // NN_SIMD_X86
+    nn__gemm_block = nn__gemm_block_scalar;
+}
+
+// Any thread may run the first GEMM, several of them at once
+static void nn__gemm_select(void)
+{
+#ifdef NN_THREADS
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, nn__gemm_pick);
+#else
+    if (nn__gemm_block == NULL) nn__gemm_pick();
+#endif // NN_THREADS
+}
+
+// C = act(A*B + bias) for a B with strided columns (e.g. a transposed matrix).
+// Every NN_GEMM_KC x NN_GEMM_PACK_NC block of B is first packed into
+// contiguous rows that the block kernels expect.
+static void nn__gemm_packed(size_t m, size_t n, size_t k,
+                            const float *a, size_t a_rs, size_t a_cs,
+                            const float *b, size_t b_rs, size_t b_cs,
+                            float *c, size_t ldc,
+                            const float *bias, Nn_Act_Row act)
+{
+    float packed[NN_GEMM_KC*NN_GEMM_PACK_NC];
+    for (size_t jc = 0; jc < n; jc += NN_GEMM_PACK_NC) {
+        size_t nc = n - jc < NN_GEMM_PACK_NC ? n - jc : NN_GEMM_PACK_NC;
+        for (size_t pc = 0; pc < k; pc += NN_GEMM_KC) {
+            size_t kc = k - pc < NN_GEMM_KC ? k - pc : NN_GEMM_KC;
+            bool last = pc + kc == k;
+            for (size_t j = 0; j < nc; ++j) {
+                const float *bj = &b[pc*b_rs + (jc + j)*b_cs];
+                for (size_t p = 0; p < kc; ++p) {
+                    packed[p*nc + j] = bj[p*b_rs];
+                }
+            }
+            nn__gemm_block(m, nc, kc,
+                           &a[pc*a_cs], a_rs, a_cs,
+                           packed, nc,
+                           &c[jc], ldc,
+                           bias ? &bias[jc] : NULL, pc > 0, last ? act : NULL);
+        }
+    }
+}
+
+// C = act(A*B + bias) split into NN_GEMM_KC x NN_GEMM_NC blocks of B.
+// Element (p, j) of B is at b[p*b_rs + j*b_cs]. The bias only seeds the
+// first block of k and the activation only runs after the last one.
+static void nn__gemm_serial(size_t m, size_t n, size_t k,
+                            const float *a, size_t a_rs, size_t a_cs,
+                            const float *b, size_t b_rs, size_t b_cs,
+                            float *c, size_t ldc,
+                            const float *bias, Nn_Act_Row act)
+{
+    nn__gemm_select();
+
+    if (k == 0) {
+        for (size_t i = 0; i < m; ++i) {
+            if (bias) memcpy(&c[i*ldc], bias, sizeof(*c)*n);
+            else      memset(&c[i*ldc], 0, sizeof(*c)*n);
+            if (act) act(&c[i*ldc], n);
+        }
+        return;
+    }
+
+    if (b_cs != 1) {
+        nn__gemm_packed(m, n, k, a, a_rs, a_cs, b, b_rs, b_cs, c, ldc, bias, act);
+        return;
+    }
+
+    for (size_t jc = 0; jc < n; jc += NN_GEMM_NC) {
+        size_t nc = n - jc < NN_GEMM_NC ? n - jc : NN_GEMM_NC;
+        for (size_t pc = 0; pc < k; pc += NN_GEMM_KC) {
+            size_t kc = k - pc < NN_GEMM_KC ? k - pc : NN_GEMM_KC;
+            bool last = pc + kc == k;
+            nn__gemm_block(m, nc, kc,
+                           &a[pc*a_cs], a_rs, a_cs,
+                           &b[pc*b_rs + jc], b_rs,
+                           &c[jc], ldc,
+                           bias ? &bias[jc] : NULL, pc > 0, last ? act : NULL);
+        }
+    }
+}
+
+typedef struct {
+    size_t n, k;
+    const float *a;
+    size_t a_rs, a_cs;
+    const float *b;
+    size_t b_rs, b_cs;
+    float *c;
+    size_t ldc;
+    const float *bias;
+    Nn_Act_Row act;
+} Nn_Gemm_Args;
+
+static void nn__gemm_rows_task(void *arg, size_t begin, size_t end, size_t worker)
+{
+    (void) worker;
+    Nn_Gemm_Args *g = arg;
+    nn__gemm_serial(end - begin, g->n, g->k,
+                    &g->a[begin*g->a_rs], g->a_rs, g->a_cs,
+                    g->b, g->b_rs, g->b_cs,
+                    &g->c[begin*g->ldc], g->ldc,
+                    g->bias, g->act);
+}
+
+// Splits the rows of C across the thread pool once there is enough work
+static void nn__gemm(size_t m, size_t n, size_t k,
+                     const float *a, size_t a_rs, size_t a_cs,
+                     const float *b, size_t b_rs, size_t b_cs,
+                     float *c, size_t ldc,
+                     const float *bias, Nn_Act_Row act)
+{
+    size_t row_work = n*k + 1;
+    size_t grain = (NN_PARALLEL_MIN_WORK + row_work - 1)/row_work;
+    grain = (grain + 3)/4*4;
+    if (m <= grain) {
+        nn__gemm_serial(m, n, k, a, a_rs, a_cs, b, b_rs, b_cs, c, ldc, bias, act);
+        return;
+    }
+
+    Nn_Gemm_Args args = {
+        .n = n, .k = k,
+        .a = a, .a_rs = a_rs, .a_cs = a_cs,
+        .b = b, .b_rs = b_rs, .b_cs = b_cs,
+        .c = c, .ldc = ldc,
+        .bias = bias, .act = act,
+    };
+    nn_parallel_for(0, m, grain, nn__gemm_rows_task, &args);
+}
+
 void mat_dot(Mat dst, Mat a, Mat b)
+{
+    NN_ASSERT(a.cols == b.rows);
+    NN_ASSERT(dst.rows == a.rows);
+    NN_ASSERT(dst.cols == b.cols);
+
+    nn__gemm(dst.rows, dst.cols, a.cols,
+             a.elements, a.stride, 1,
+             b.elements, b.stride, 1,
+             dst.elements, dst.stride,
+             NULL, NULL);
+}
+
+void mat_dot_at(Mat dst, Mat a, Mat b)
+{
+    NN_ASSERT(a.rows == b.rows);
+    NN_ASSERT(dst.rows == a.cols);
+    NN_ASSERT(dst.cols == b.cols);
+
+    nn__gemm(dst.rows, dst.cols, a.rows,
+             a.elements, 1, a.stride,
+             b.elements, b.stride, 1,
+             dst.elements, dst.stride,
+             NULL, NULL);
+}
+
+void mat_dot_bt(Mat dst, Mat a, Mat b)
+{
+    NN_ASSERT(a.cols == b.cols);
+    NN_ASSERT(dst.rows == a.rows);
+    NN_ASSERT(dst.cols == b.rows);
+
+    nn__gemm(dst.rows, dst.cols, a.cols,
+             a.elements, a.stride, 1,
+             b.elements, 1, b.stride,
+             dst.elements, dst.stride,
+             NULL, NULL);
+}
+
+void mat_dense(Mat dst, Mat a, Mat w, Row b, Act act)
+{
+    NN_ASSERT(a.cols == w.rows);
+    NN_ASSERT(dst.rows == a.rows);
+    NN_ASSERT(dst.cols == w.cols);
+    NN_ASSERT(b.cols == w.cols);
+
+    nn__gemm(dst.rows, dst.cols, a.cols,
+             a.elements, a.stride, 1,
+             w.elements, w.stride, 1,
+             dst.elements, dst.stride,
+             b.elements, nn__act_row(act));
+}
+
+void mat_dot_naive(Mat dst, Mat a, Mat b)
 {
     NN_ASSERT(a.cols == b.rows);
     size_t n = a.cols;
@@ -223,6 +1306,28 @@ Row mat_row(Mat m, size_t row)
     };
 }
 
+Mat mat_slice(Mat m, size_t row, size_t col, size_t rows, size_t cols)
+{
+    NN_ASSERT(row + rows <= m.rows);
+    NN_ASSERT(col + cols <= m.cols);
+    return (Mat) {
+        .rows = rows,
+        .cols = cols,
+        .stride = m.stride,
+        .elements = m.elements + row*m.stride + col,
+    };
+}
+
+Mat mat_slice_rows(Mat m, size_t row, size_t rows)
+{
+    return mat_slice(m, row, 0, rows, m.cols);
+}
+
+Mat mat_slice_cols(Mat m, size_t col, size_t cols)
+{
+    return mat_slice(m, 0, col, m.rows, cols);
+}
+
 void mat_copy(Mat dst, Mat src)
 {
     NN_ASSERT(dst.rows == src.rows);
@@ -247,10 +1352,9 @@ void mat_sum(Mat dst, Mat a)
 
 void mat_act(Mat m)
 {
+    Nn_Act_Row act = nn__act_row(NN_ACT);
     for (size_t i = 0; i < m.rows; ++i) {
-        for (size_t j = 0; j < m.cols; ++j) {
-            MAT_AT(m, i, j) = actf(MAT_AT(m, i, j), NN_ACT);
-        }
+        act(&MAT_AT(m, i, 0), m.cols);
     }
 }
 
@@ -285,7 +1389,21 @@ void mat_rand(Mat m, float low, float high)
     }
 }
 
-NN nn_alloc(Region *r, size_t *arch, size_t arch_count)
+// Regions are aligned enough on their own. NN_MALLOC memory is
+// over-allocated by alignment-1 bytes and the pointer is rounded up.
+static void *nn__alloc_aligned(Region *r, size_t size_bytes, size_t alignment)
+{
+    NN_ASSERT((alignment & (alignment - 1)) == 0);
+    if (r != NULL && alignment <= NN_REGION_ALIGNMENT) return region_alloc(r, size_bytes);
+    uintptr_t p = (uintptr_t) region_alloc(r, size_bytes + alignment - 1);
+    if (p == 0) return NULL;
+    return (void*) ((p + alignment - 1) & ~(uintptr_t)(alignment - 1));
+}
+
+// Gradients never get forwarded, so they are allocated without the
+// activations and their as is NULL. If params is not NULL the NN is a view of
+// those parameters instead of having its own.
+static NN nn__alloc(Region *r, size_t *arch, size_t arch_count, bool activations, float *params)
 {
     NN_ASSERT(arch_count > 0);
 
@@ -297,27 +1415,69 @@ NN nn_alloc(Region *r, size_t *arch, size_t arch_count)
     NN_ASSERT(nn.ws != NULL);
     nn.bs = region_alloc(r, sizeof(*nn.bs)*(nn.arch_count - 1));
     NN_ASSERT(nn.bs != NULL);
-    nn.as = region_alloc(r, sizeof(*nn.as)*nn.arch_count);
-    NN_ASSERT(nn.as != NULL);
+    nn.as = NULL;
+    if (activations) {
+        nn.as = region_alloc(r, sizeof(*nn.as)*nn.arch_count);
+        NN_ASSERT(nn.as != NULL);
+    }
+
+    nn.params_count = nn_params_count(arch, arch_count);
+    nn.mapped_size = 0;
+    nn.params = params;
+    if (nn.params == NULL) {
+        nn.params = nn__alloc_aligned(r, sizeof(*nn.params)*nn.params_count, NN_PARAMS_ALIGNMENT);
+        NN_ASSERT(nn.params != NULL);
+    }
 
-    nn.as[0] = row_alloc(r, arch[0]);
+    float *p = nn.params;
+    if (activations) nn.as[0] = row_alloc(r, arch[0]);
     for (size_t i = 1; i < arch_count; ++i) {
-        nn.ws[i-1] = mat_alloc(r, nn.as[i-1].cols, arch[i]);
-        nn.bs[i-1] = row_alloc(r, arch[i]);
-        nn.as[i]   = row_alloc(r, arch[i]);
+        nn.ws[i-1] = (Mat) {
+            .rows = arch[i-1],
+            .cols = arch[i],
+            .stride = arch[i],
+            .elements = p,
+        };
+        p += arch[i-1]*arch[i];
+        nn.bs[i-1] = (Row) {
+            .cols = arch[i],
+            .elements = p,
+        };
+        p += arch[i];
+        if (activations) nn.as[i] = row_alloc(r, arch[i]);
     }
+    NN_ASSERT(p == nn.params + nn.params_count);
 
     return nn;
 }
 
-void nn_zero(NN nn)
+NN nn_alloc(Region *r, size_t *arch, size_t arch_count)
 {
-    for (size_t i = 0; i < nn.arch_count - 1; ++i) {
-        mat_fill(nn.ws[i], 0);
-        row_fill(nn.bs[i], 0);
-        row_fill(nn.as[i], 0);
-    }
-    row_fill(nn.as[nn.arch_count - 1], 0);
+    return nn__alloc(r, arch, arch_count, true, NULL);
+}
+
+size_t nn_params_count(size_t *arch, size_t arch_count)
+{
+    size_t count = 0;
+    for (size_t i = 1; i < arch_count; ++i) {
+        count += arch[i-1]*arch[i] + arch[i];
+    }
+    return count;
+}
+
+void nn_copy(NN dst, NN src)
+{
+    NN_ASSERT(dst.params_count == src.params_count);
+    memcpy(dst.params, src.params, sizeof(*dst.params)*dst.params_count);
+}
+
+void nn_zero(NN nn)
+{
+    memset(nn.params, 0, sizeof(*nn.params)*nn.params_count);
+    if (nn.as == NULL) return;
+    for (size_t i = 0; i < nn.arch_count; ++i) {
+        row_fill(nn.as[i], 0);
+    }
 }
 
 void nn_print(NN nn, const char *name)
@@ -335,229 +1495,2160 @@ void nn_print(NN nn, const char *name)
 
 void nn_rand(NN nn, float low, float high)
 {
-    for (size_t i = 0; i < nn.arch_count-1; ++i) {
-        mat_rand(nn.ws[i], low, high);
-        row_rand(nn.bs[i], low, high);
+    for (size_t i = 0; i < nn.params_count; ++i) {
+        nn.params[i] = rand_float()*(high - low) + low;
     }
 }
 
-void nn_forward(NN nn)
+Mat nn_forward(Region *r, NN nn, Mat in)
+{
+    Mat out = mat_alloc(r, in.rows, nn.arch[nn.arch_count-1]);
+    nn_forward_batch(r, nn, in, out);
+    return out;
+}
+
+void nn_forward_activations(NN nn)
 {
     for (size_t i = 0; i < nn.arch_count-1; ++i) {
-        mat_dot(row_as_mat(nn.as[i+1]), row_as_mat(nn.as[i]), nn.ws[i]);
-        mat_sum(row_as_mat(nn.as[i+1]), row_as_mat(nn.bs[i]));
-        mat_act(row_as_mat(nn.as[i+1]));
+        mat_dense(row_as_mat(nn.as[i+1]), row_as_mat(nn.as[i]), nn.ws[i], nn.bs[i], NN_ACT);
     }
 }
 
-float nn_cost(NN nn, Mat t)
+// nn_forward_batch() straight over the flat parameters, so NN and Model
+// share it
+static void nn__forward_params(Region *r, const size_t *arch, size_t arch_count, const float *params, Mat in, Mat out)
 {
-    NN_ASSERT(NN_INPUT(nn).cols + NN_OUTPUT(nn).cols == t.cols);
-    size_t n = t.rows;
+    NN_ASSERT(in.rows == out.rows);
+    NN_ASSERT(in.cols == arch[0]);
+    NN_ASSERT(out.cols == arch[arch_count-1]);
 
-    float c = 0;
-    for (size_t i = 0; i < n; ++i) {
-        Row row = mat_row(t, i);
-        Row x = row_slice(row, 0, NN_INPUT(nn).cols);
-        Row y = row_slice(row, NN_INPUT(nn).cols, NN_OUTPUT(nn).cols);
-
-        row_copy(NN_INPUT(nn), x);
-        nn_forward(nn);
-        size_t q = y.cols;
-        for (size_t j = 0; j < q; ++j) {
-            float d = ROW_AT(NN_OUTPUT(nn), j) - ROW_AT(y, j);
-            c += d*d;
+    if (arch_count == 1) {
+        mat_copy(out, in);
+        return;
+    }
+
+    size_t n = in.rows;
+    size_t width = 0;
+    for (size_t l = 1; l + 1 < arch_count; ++l) {
+        if (width < arch[l]) width = arch[l];
+    }
+
+    size_t s = region_save(r);
+    // The hidden layers ping-pong between two n x width buffers
+    float *scratch[2] = {
+        region_alloc(r, sizeof(float)*n*width),
+        region_alloc(r, sizeof(float)*n*width),
+    };
+
+    // Only read, the const is cast away just to fit into a Mat
+    float *p = (float*) params;
+    Mat a = in;
+    for (size_t l = 0; l < arch_count-1; ++l) {
+        Mat w = {
+            .rows = arch[l],
+            .cols = arch[l+1],
+            .stride = arch[l+1],
+            .elements = p,
+        };
+        p += arch[l]*arch[l+1];
+        Row bias = {
+            .cols = arch[l+1],
+            .elements = p,
+        };
+        p += arch[l+1];
+
+        Mat b = out;
+        if (l + 2 < arch_count) {
+            b = (Mat) {
+                .rows = n,
+                .cols = arch[l+1],
+                .stride = arch[l+1],
+                .elements = scratch[l%2],
+            };
         }
+        mat_dense(b, a, w, bias, NN_ACT);
+        a = b;
     }
 
-    return c/n;
+    region_rewind(r, s);
 }
 
-NN nn_backprop(Region *r, NN nn, Mat t)
+void nn_forward_batch(Region *r, NN nn, Mat in, Mat out)
 {
-    size_t n = t.rows;
-    NN_ASSERT(NN_INPUT(nn).cols + NN_OUTPUT(nn).cols == t.cols);
+    nn__forward_params(r, nn.arch, nn.arch_count, nn.params, in, out);
+}
 
-    NN g = nn_alloc(r, nn.arch, nn.arch_count);
-    nn_zero(g);
+Model nn_freeze(Region *r, NN nn)
+{
+    size_t arch_bytes = region_footprint(sizeof(*nn.arch)*nn.arch_count);
+    char *block = nn__alloc_aligned(r, arch_bytes + sizeof(*nn.params)*nn.params_count, NN_PARAMS_ALIGNMENT);
+    NN_ASSERT(block != NULL);
+    memcpy(block, nn.arch, sizeof(*nn.arch)*nn.arch_count);
+    memcpy(block + arch_bytes, nn.params, sizeof(*nn.params)*nn.params_count);
+    return (Model) {
+        .act = NN_ACT,
+        .arch_count = nn.arch_count,
+        .arch = (const size_t*) block,
+        .params_count = nn.params_count,
+        .params = (const float*) (block + arch_bytes),
+    };
+}
+
+Mat model_forward(Region *r, Model m, Mat in)
+{
+    NN_ASSERT(m.act == NN_ACT && "Model was frozen with a different NN_ACT");
+    Mat out = mat_alloc(r, in.rows, m.arch[m.arch_count-1]);
+    nn__forward_params(r, m.arch, m.arch_count, m.params, in, out);
+    return out;
+}
 
-    // i - current sample
-    // l - current layer
-    // j - current activation
-    // k - previous activation
+#define NN_FILE_MAGIC     "nn.h"
+#define NN_FILE_VERSION   1
+#define NN_FILE_ALIGNMENT 64
 
-    for (size_t i = 0; i < n; ++i) {
-        Row row = mat_row(t, i);
-        Row in = row_slice(row, 0, NN_INPUT(nn).cols);
-        Row out = row_slice(row, NN_INPUT(nn).cols, NN_OUTPUT(nn).cols);
+// The file starts with it, followed by arch_count uint64_t layer sizes at
+// NN_FILE_ALIGNMENT and then by params_count floats at params_offset. Every
+// field is in the byte order of the machine that saved it.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t act;
+    uint32_t reserved;
+    uint64_t arch_count;
+    uint64_t params_count;
+    uint64_t params_offset;
+} Nn_File_Header;
+
+static size_t nn__file_align(size_t size)
+{
+    return (size + NN_FILE_ALIGNMENT - 1)/NN_FILE_ALIGNMENT*NN_FILE_ALIGNMENT;
+}
+
+static size_t nn__file_params_offset(size_t arch_count)
+{
+    return nn__file_align(sizeof(Nn_File_Header)) + nn__file_align(sizeof(uint64_t)*arch_count);
+}
+
+static bool nn__file_pad(FILE *f, size_t size)
+{
+    static const char zeros[NN_FILE_ALIGNMENT] = {0};
+    size_t pad = nn__file_align(size) - size;
+    return fwrite(zeros, 1, pad, f) == pad;
+}
+
+// Whatever comes after the parameters is a list of sections, each one a
+// Nn_File_Section followed by size bytes, both padded to NN_FILE_ALIGNMENT.
+// Loading a model ignores them.
+typedef struct {
+    char tag[4];
+    uint32_t reserved;
+    uint64_t size;
+} Nn_File_Section;
+
+static bool nn__file_section(FILE *f, const char *tag, size_t size)
+{
+    Nn_File_Section section = {
+        .size = size,
+    };
+    memcpy(section.tag, tag, sizeof(section.tag));
+    return fwrite(&section, sizeof(section), 1, f) == 1 && nn__file_pad(f, sizeof(section));
+}
+
+static bool nn__file_write_model(FILE *f, const size_t *arch, size_t arch_count, const float *params, size_t params_count)
+{
+    Nn_File_Header header = {
+        .version = NN_FILE_VERSION,
+        .act = NN_ACT,
+        .arch_count = arch_count,
+        .params_count = params_count,
+        .params_offset = nn__file_params_offset(arch_count),
+    };
+    memcpy(header.magic, NN_FILE_MAGIC, sizeof(header.magic));
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && nn__file_pad(f, sizeof(header));
+    for (size_t i = 0; ok && i < arch_count; ++i) {
+        uint64_t x = arch[i];
+        ok = fwrite(&x, sizeof(x), 1, f) == 1;
+    }
+    ok = ok && nn__file_pad(f, sizeof(uint64_t)*arch_count);
+    ok = ok && fwrite(params, sizeof(*params), params_count, f) == params_count;
+    return ok && nn__file_pad(f, sizeof(*params)*params_count);
+}
+
+bool nn_save(const char *file_path, NN nn)
+{
+    FILE *f = fopen(file_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+
+    bool ok = nn__file_write_model(f, nn.arch, nn.arch_count, nn.params, nn.params_count);
+    if (fclose(f) != 0) ok = false;
+
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not write %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+    return true;
+}
 
-        row_copy(NN_INPUT(nn), in);
-        nn_forward(nn);
+// Checks everything the header claims against itself and the size of the file
+static bool nn__file_check(const char *file_path, const char *data, size_t size)
+{
+    Nn_File_Header header;
+    if (size < sizeof(header)) {
+        fprintf(stderr, "ERROR: %s is too small to be a model\n", file_path);
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    if (memcmp(header.magic, NN_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        fprintf(stderr, "ERROR: %s is not a model\n", file_path);
+        return false;
+    }
+    if (header.version != NN_FILE_VERSION) {
+        fprintf(stderr, "ERROR: %s has unsupported version %u, expected %u\n", file_path, header.version, NN_FILE_VERSION);
+        return false;
+    }
+    if (header.act != NN_ACT) {
+        fprintf(stderr, "ERROR: %s was trained with activation %u, but NN_ACT is %u\n", file_path, header.act, (unsigned) NN_ACT);
+        return false;
+    }
+    if (header.arch_count == 0 || header.arch_count > (size - sizeof(header))/sizeof(uint64_t) ||
+        header.params_offset != nn__file_params_offset(header.arch_count) || header.params_offset > size) {
+        fprintf(stderr, "ERROR: %s has a corrupted arch\n", file_path);
+        return false;
+    }
 
-        for (size_t j = 0; j < nn.arch_count; ++j) {
-            row_fill(g.as[j], 0);
+    // nn_params_count() of the arch, except that no layer is trusted to
+    // be small enough not to overflow it
+    size_t limit = (size - header.params_offset)/sizeof(float);
+    size_t count = 0;
+    uint64_t prev = 0;
+    for (size_t i = 0; i < header.arch_count; ++i) {
+        uint64_t x;
+        memcpy(&x, data + nn__file_align(sizeof(header)) + sizeof(x)*i, sizeof(x));
+        if (x == 0 || (i > 0 && prev + 1 > (limit - count)/x)) {
+            fprintf(stderr, "ERROR: %s has a corrupted arch\n", file_path);
+            return false;
         }
+        if (i > 0) count += (prev + 1)*x;
+        prev = x;
+    }
+    if (header.params_count != count) {
+        fprintf(stderr, "ERROR: %s has corrupted parameters\n", file_path);
+        return false;
+    }
+    return true;
+}
 
-        for (size_t j = 0; j < out.cols; ++j) {
-#ifdef NN_BACKPROP_TRADITIONAL
-            ROW_AT(NN_OUTPUT(g), j) = 2*(ROW_AT(NN_OUTPUT(nn), j) - ROW_AT(out, j));
+// NN around the parameters of a checked file that live at data
+static NN nn__file_nn(Region *r, const char *data)
+{
+    Nn_File_Header header;
+    memcpy(&header, data, sizeof(header));
+
+    size_t *arch = region_alloc(r, sizeof(*arch)*header.arch_count);
+    NN_ASSERT(arch != NULL);
+    for (size_t i = 0; i < header.arch_count; ++i) {
+        uint64_t x;
+        memcpy(&x, data + nn__file_align(sizeof(header)) + sizeof(x)*i, sizeof(x));
+        arch[i] = x;
+    }
+    return nn__alloc(r, arch, header.arch_count, true, (float*) (data + header.params_offset));
+}
+
+// Maps a whole file (or reads it into r where there is no mmap) and checks
+// that it's a model
+static bool nn__file_open(Region *r, const char *file_path, char **data, size_t *size)
+{
+#ifdef NN_REGION_MMAP
+    (void) r;
+    int fd = open(file_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "ERROR: could not stat %s: %s\n", file_path, strerror(errno));
+        close(fd);
+        return false;
+    }
+    *size = st.st_size;
+    if (*size == 0) {
+        fprintf(stderr, "ERROR: %s is empty\n", file_path);
+        close(fd);
+        return false;
+    }
+
+    // Private and writable, so the NN can still be trained further. The
+    // pages are only copied once something writes into them.
+    void *m = mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED) {
+        fprintf(stderr, "ERROR: could not map %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+    *data = m;
 #else
-            ROW_AT(NN_OUTPUT(g), j) = ROW_AT(NN_OUTPUT(nn), j) - ROW_AT(out, j);
-#endif // NN_BACKPROP_TRADITIONAL
-        }
+    FILE *f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", file_path, strerror(errno));
+        return false;
+    }
+    long n = -1;
+    if (fseek(f, 0, SEEK_END) == 0) n = ftell(f);
+    if (n <= 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: could not get the size of %s\n", file_path);
+        fclose(f);
+        return false;
+    }
+    *size = n;
+
+    *data = nn__alloc_aligned(r, *size, NN_FILE_ALIGNMENT);
+    NN_ASSERT(*data != NULL);
+    bool ok = fread(*data, 1, *size, f) == *size;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not read %s\n", file_path);
+        return false;
+    }
+#endif // NN_REGION_MMAP
 
-#ifdef NN_BACKPROP_TRADITIONAL
-        float s = 1;
+    if (!nn__file_check(file_path, *data, *size)) {
+#ifdef NN_REGION_MMAP
+        munmap(*data, *size);
+#endif // NN_REGION_MMAP
+        return false;
+    }
+    return true;
+}
+
+bool nn_load_mmap(Region *r, const char *file_path, NN *nn)
+{
+    char *data;
+    size_t size;
+    if (!nn__file_open(r, file_path, &data, &size)) return false;
+    *nn = nn__file_nn(r, data);
+#ifdef NN_REGION_MMAP
+    nn->mapped_size = size;
+#endif // NN_REGION_MMAP
+    return true;
+}
+
+void nn_unload_mmap(NN nn)
+{
+#ifdef NN_REGION_MMAP
+    NN_ASSERT(nn.mapped_size > 0);
+    munmap((char*) nn.params - nn__file_params_offset(nn.arch_count), nn.mapped_size);
 #else
-        float s = 2;
-#endif // NN_BACKPROP_TRADITIONAL
+    // The file was read into the Region, which is what frees it
+    (void) nn;
+#endif // NN_REGION_MMAP
+}
 
-        for (size_t l = nn.arch_count-1; l > 0; --l) {
-            for (size_t j = 0; j < nn.as[l].cols; ++j) {
-                float a = ROW_AT(nn.as[l], j);
-                float da = ROW_AT(g.as[l], j);
-                float qa = dactf(a, NN_ACT);
-                ROW_AT(g.bs[l-1], j) += s*da*qa;
-                for (size_t k = 0; k < nn.as[l-1].cols; ++k) {
-                    // j - weight matrix col
-                    // k - weight matrix row
-                    float pa = ROW_AT(nn.as[l-1], k);
-                    float w = MAT_AT(nn.ws[l-1], k, j);
-                    MAT_AT(g.ws[l-1], k, j) += s*da*qa*pa;
-                    ROW_AT(g.as[l-1], k) += s*da*qa*w;
-                }
-            }
+bool nn_load(const char *file_path, NN nn)
+{
+    return checkpoint_load(file_path, nn, NULL, NULL, NULL);
+}
+
+typedef struct {
+    NN nn;
+    Mat t;
+    Region *scratch;
+    float *costs;
+} Nn_Cost_Ctx;
+
+static void nn__cost_task(void *arg, size_t begin, size_t end, size_t worker)
+{
+    Nn_Cost_Ctx *ctx = arg;
+    NN nn = ctx->nn;
+    Region *r = &ctx->scratch[worker];
+    size_t n = end - begin;
+
+    size_t s = region_save(r);
+    Mat t = mat_slice_rows(ctx->t, begin, n);
+    Mat x = mat_slice_cols(t, 0, nn.arch[0]);
+    Mat y = mat_slice_cols(t, x.cols, nn.arch[nn.arch_count-1]);
+    Mat out = mat_alloc(r, n, y.cols);
+
+    nn_forward_batch(r, nn, x, out);
+
+    float c = 0;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < y.cols; ++j) {
+            float d = MAT_AT(out, i, j) - MAT_AT(y, i, j);
+            c += d*d;
         }
     }
+    ctx->costs[worker] += c;
+    region_rewind(r, s);
+}
 
-    for (size_t i = 0; i < g.arch_count-1; ++i) {
-        for (size_t j = 0; j < g.ws[i].rows; ++j) {
-            for (size_t k = 0; k < g.ws[i].cols; ++k) {
-                MAT_AT(g.ws[i], j, k) /= n;
-            }
-        }
-        for (size_t k = 0; k < g.bs[i].cols; ++k) {
-            ROW_AT(g.bs[i], k) /= n;
-        }
+// nn_cost() forwards the rows in pieces of grain rows, each worker with its
+// own scratch big enough for one piece
+static size_t nn__cost_grain(size_t *arch, size_t arch_count, size_t n, size_t *width)
+{
+    size_t row_work = 1;
+    *width = 0;
+    for (size_t l = 0; l < arch_count; ++l) {
+        if (l + 1 < arch_count) row_work += arch[l]*arch[l+1];
+        if (*width < arch[l]) *width = arch[l];
     }
+    size_t grain = (NN_PARALLEL_MIN_WORK + row_work - 1)/row_work;
+    if (grain < 16) grain = 16;
+    if (grain > n) grain = n;
+    return grain;
+}
 
-    return g;
+static size_t nn__cost_scratch_bytes(size_t *arch, size_t arch_count, size_t grain, size_t width)
+{
+    return region_footprint(sizeof(float)*grain*arch[arch_count - 1]) +
+           2*region_footprint(sizeof(float)*grain*width);
 }
 
-NN nn_finite_diff(Region *r, NN nn, Mat t, float eps)
+float nn_cost(Region *r, NN nn, Mat t)
 {
-    float saved;
-    float c = nn_cost(nn, t);
+    NN_ASSERT(nn.arch[0] + nn.arch[nn.arch_count-1] == t.cols);
+    size_t n = t.rows;
 
-    NN g = nn_alloc(r, nn.arch, nn.arch_count);
+    size_t width;
+    size_t grain = nn__cost_grain(nn.arch, nn.arch_count, n, &width);
 
-    for (size_t i = 0; i < nn.arch_count-1; ++i) {
-        for (size_t j = 0; j < nn.ws[i].rows; ++j) {
-            for (size_t k = 0; k < nn.ws[i].cols; ++k) {
-                saved = MAT_AT(nn.ws[i], j, k);
-                MAT_AT(nn.ws[i], j, k) += eps;
-                MAT_AT(g.ws[i], j, k) = (nn_cost(nn, t) - c)/eps;
-                MAT_AT(nn.ws[i], j, k) = saved;
-            }
-        }
+    size_t s = region_save(r);
+    size_t workers = nn_threads_count();
+    Nn_Cost_Ctx ctx = {
+        .nn = nn,
+        .t = t,
+    };
+    ctx.costs = region_alloc(r, sizeof(*ctx.costs)*workers);
+    NN_ASSERT(ctx.costs != NULL);
+    ctx.scratch = region_alloc(r, sizeof(*ctx.scratch)*workers);
+    NN_ASSERT(ctx.scratch != NULL);
+    for (size_t i = 0; i < workers; ++i) {
+        ctx.costs[i] = 0;
+        ctx.scratch[i] = region_sub(r, nn__cost_scratch_bytes(nn.arch, nn.arch_count, grain, width));
+    }
 
-        for (size_t k = 0; k < nn.bs[i].cols; ++k) {
-            saved = ROW_AT(nn.bs[i], k);
-            ROW_AT(nn.bs[i], k) += eps;
-            ROW_AT(g.bs[i], k) = (nn_cost(nn, t) - c)/eps;
-            ROW_AT(nn.bs[i], k) = saved;
-        }
+    nn_parallel_for(0, n, grain, nn__cost_task, &ctx);
+
+    float c = 0;
+    for (size_t i = 0; i < workers; ++i) {
+        c += ctx.costs[i];
     }
+    region_rewind(r, s);
 
-    return g;
+    return c/n;
 }
 
-void nn_learn(NN nn, NN g, float rate)
+#ifdef NN_THREADS
+// Range of a parallel for that is still left to a worker. The owner takes
+// grains from the front, thieves take the back half.
+typedef struct {
+    pthread_mutex_t mutex;
+    size_t begin;
+    size_t end;
+    char padding[64];
+} Nn_Pool_Slot;
+
+// The pool is started on the first use and lives until the process exits or
+// nn_threads_set_count() asks for a different size. Worker 0 is always the
+// thread that submitted the work, the rest sleep on the start condition
+// between the runs. Only one run can own the pool at a time, the others
+// (including the nested ones) just run serially on their own thread.
+typedef struct {
+    bool started;
+    bool quit;
+    size_t requested;
+    size_t count;
+    pthread_t *threads;
+    Nn_Pool_Slot *slots;
+    pthread_mutex_t run;
+    pthread_mutex_t mutex;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    size_t generation;
+    size_t pending;
+    Nn_Task task;
+    void *arg;
+} Nn_Pool;
+
+static Nn_Pool nn__pool = {
+    .run = PTHREAD_MUTEX_INITIALIZER,
+    .mutex = PTHREAD_MUTEX_INITIALIZER,
+    .start = PTHREAD_COND_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER,
+};
+
+static void *nn__pool_worker(void *arg)
 {
-    for (size_t i = 0; i < nn.arch_count-1; ++i) {
-        for (size_t j = 0; j < nn.ws[i].rows; ++j) {
-            for (size_t k = 0; k < nn.ws[i].cols; ++k) {
-                MAT_AT(nn.ws[i], j, k) -= rate*MAT_AT(g.ws[i], j, k);
-            }
+    size_t worker = (size_t)(uintptr_t)arg;
+    size_t generation = 0;
+
+    pthread_mutex_lock(&nn__pool.mutex);
+    for (;;) {
+        while (nn__pool.generation == generation) {
+            pthread_cond_wait(&nn__pool.start, &nn__pool.mutex);
         }
+        generation = nn__pool.generation;
+        if (nn__pool.quit) break;
+        Nn_Task task = nn__pool.task;
+        void *task_arg = nn__pool.arg;
+        pthread_mutex_unlock(&nn__pool.mutex);
+
+        task(task_arg, worker);
+
+        pthread_mutex_lock(&nn__pool.mutex);
+        nn__pool.pending -= 1;
+        if (nn__pool.pending == 0) pthread_cond_signal(&nn__pool.done);
+    }
+    pthread_mutex_unlock(&nn__pool.mutex);
+    return NULL;
+}
+
+static size_t nn__pool_desired_count(void)
+{
+    if (nn__pool.requested > 0) return nn__pool.requested;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (size_t)cpus : 1;
+}
+
+// Both nn__pool_start() and nn__pool_stop() expect nn__pool.run to be locked
+static void nn__pool_stop(void)
+{
+    if (!nn__pool.started) return;
+
+    pthread_mutex_lock(&nn__pool.mutex);
+    nn__pool.quit = true;
+    nn__pool.generation += 1;
+    pthread_cond_broadcast(&nn__pool.start);
+    pthread_mutex_unlock(&nn__pool.mutex);
+
+    for (size_t i = 1; i < nn__pool.count; ++i) {
+        pthread_join(nn__pool.threads[i], NULL);
+    }
+    for (size_t i = 0; i < nn__pool.count; ++i) {
+        pthread_mutex_destroy(&nn__pool.slots[i].mutex);
+    }
+    NN_FREE(nn__pool.threads);
+    NN_FREE(nn__pool.slots);
+    // The next workers start counting the generations from scratch
+    nn__pool.generation = 0;
+    nn__pool.quit = false;
+    // nn_threads_count() looks at it from any thread
+    pthread_mutex_lock(&nn__pool.mutex);
+    nn__pool.started = false;
+    pthread_mutex_unlock(&nn__pool.mutex);
+}
 
-        for (size_t k = 0; k < nn.bs[i].cols; ++k) {
-            ROW_AT(nn.bs[i], k) -= rate*ROW_AT(g.bs[i], k);
+static void nn__pool_start(void)
+{
+    if (nn__pool.started) return;
+    // The kernels are picked before the workers could race on it
+    nn__gemm_select();
+
+    nn__pool.count = nn__pool_desired_count();
+    nn__pool.threads = NN_MALLOC(sizeof(*nn__pool.threads)*nn__pool.count);
+    NN_ASSERT(nn__pool.threads != NULL);
+    nn__pool.slots = NN_MALLOC(sizeof(*nn__pool.slots)*nn__pool.count);
+    NN_ASSERT(nn__pool.slots != NULL);
+    for (size_t i = 0; i < nn__pool.count; ++i) {
+        pthread_mutex_init(&nn__pool.slots[i].mutex, NULL);
+    }
+    for (size_t i = 1; i < nn__pool.count; ++i) {
+        int ret = pthread_create(&nn__pool.threads[i], NULL, nn__pool_worker, (void*)(uintptr_t)i);
+        NN_ASSERT(ret == 0);
+    }
+    pthread_mutex_lock(&nn__pool.mutex);
+    nn__pool.started = true;
+    pthread_mutex_unlock(&nn__pool.mutex);
+}
+
+void nn_threads_set_count(size_t count)
+{
+    pthread_mutex_lock(&nn__pool.run);
+    nn__pool.requested = count;
+    if (nn__pool.started && nn__pool.count != nn__pool_desired_count()) {
+        nn__pool_stop();
+    }
+    pthread_mutex_unlock(&nn__pool.run);
+}
+
+size_t nn_threads_count(void)
+{
+    pthread_mutex_lock(&nn__pool.mutex);
+    size_t count = nn__pool.started ? nn__pool.count : nn__pool_desired_count();
+    pthread_mutex_unlock(&nn__pool.mutex);
+    return count;
+}
+
+// Expects nn__pool.run to be locked by the caller
+static void nn__pool_dispatch(Nn_Task task, void *arg)
+{
+    pthread_mutex_lock(&nn__pool.mutex);
+    nn__pool.task = task;
+    nn__pool.arg = arg;
+    nn__pool.pending = nn__pool.count - 1;
+    nn__pool.generation += 1;
+    pthread_cond_broadcast(&nn__pool.start);
+    pthread_mutex_unlock(&nn__pool.mutex);
+
+    task(arg, 0);
+
+    pthread_mutex_lock(&nn__pool.mutex);
+    while (nn__pool.pending > 0) {
+        pthread_cond_wait(&nn__pool.done, &nn__pool.mutex);
+    }
+    pthread_mutex_unlock(&nn__pool.mutex);
+}
+
+void nn_threads_run(Nn_Task task, void *arg)
+{
+    if (pthread_mutex_trylock(&nn__pool.run) != 0) {
+        size_t count = nn_threads_count();
+        for (size_t worker = 0; worker < count; ++worker) {
+            task(arg, worker);
         }
+        return;
     }
+    nn__pool_start();
+    nn__pool_dispatch(task, arg);
+    pthread_mutex_unlock(&nn__pool.run);
 }
 
-void mat_shuffle_rows(Mat m)
+typedef struct {
+    size_t grain;
+    Nn_Range_Task task;
+    void *arg;
+} Nn_Parallel_For;
+
+// Takes up to grain iterations from the front of the slot
+static bool nn__slot_take(Nn_Pool_Slot *slot, size_t grain, size_t *begin, size_t *end)
 {
-    for (size_t i = 0; i < m.rows; ++i) {
-         size_t j = i + rand()%(m.rows - i);
-         if (i != j) {
-             for (size_t k = 0; k < m.cols; ++k) {
-                 float t = MAT_AT(m, i, k);
-                 MAT_AT(m, i, k) = MAT_AT(m, j, k);
-                 MAT_AT(m, j, k) = t;
-             }
-         }
+    bool taken = false;
+    pthread_mutex_lock(&slot->mutex);
+    if (slot->begin < slot->end) {
+        *begin = slot->begin;
+        *end = slot->end - slot->begin < grain ? slot->end : slot->begin + grain;
+        slot->begin = *end;
+        taken = true;
     }
+    pthread_mutex_unlock(&slot->mutex);
+    return taken;
 }
 
-void batch_process(Region *r, Batch *b, size_t batch_size, NN nn, Mat t, float rate)
+// Takes the back half of the slot, or all of it if that is less than a grain
+static bool nn__slot_steal(Nn_Pool_Slot *slot, size_t grain, size_t *begin, size_t *end)
 {
-    if (b->finished) {
-        b->finished = false;
-        b->begin = 0;
-        b->cost = 0;
+    bool stolen = false;
+    pthread_mutex_lock(&slot->mutex);
+    size_t left = slot->end - slot->begin;
+    if (left > 0) {
+        *begin = left <= grain ? slot->begin : slot->begin + left/2;
+        *end = slot->end;
+        slot->end = *begin;
+        stolen = true;
     }
+    pthread_mutex_unlock(&slot->mutex);
+    return stolen;
+}
 
-    size_t size = batch_size;
-    if (b->begin + batch_size >= t.rows)  {
-        size = t.rows - b->begin;
+static void nn__parallel_for_task(void *arg, size_t worker)
+{
+    Nn_Parallel_For *pf = arg;
+    Nn_Pool_Slot *own = &nn__pool.slots[worker];
+    size_t begin, end;
+    for (;;) {
+        while (nn__slot_take(own, pf->grain, &begin, &end)) {
+            pf->task(pf->arg, begin, end, worker);
+        }
+
+        // Out of own work. Steal from the fullest slot, so one steal
+        // usually brings enough work for a while.
+        size_t victim = worker;
+        size_t most = 0;
+        for (size_t i = 0; i < nn__pool.count; ++i) {
+            if (i == worker) continue;
+            pthread_mutex_lock(&nn__pool.slots[i].mutex);
+            size_t left = nn__pool.slots[i].end - nn__pool.slots[i].begin;
+            pthread_mutex_unlock(&nn__pool.slots[i].mutex);
+            if (left > most) {
+                most = left;
+                victim = i;
+            }
+        }
+        if (victim == worker) break;
+        if (!nn__slot_steal(&nn__pool.slots[victim], pf->grain, &begin, &end)) continue;
+
+        pthread_mutex_lock(&own->mutex);
+        own->begin = begin;
+        own->end = end;
+        pthread_mutex_unlock(&own->mutex);
+    }
+}
+
+void nn_parallel_for(size_t begin, size_t end, size_t grain, Nn_Range_Task task, void *arg)
+{
+    if (grain == 0) grain = 1;
+    if (end - begin <= grain || pthread_mutex_trylock(&nn__pool.run) != 0) {
+        for (size_t i = begin; i < end; i += grain) {
+            task(arg, i, end - i < grain ? end : i + grain, 0);
+        }
+        return;
     }
+    nn__pool_start();
 
-    // TODO: introduce similar to row_slice operation but for Mat that will give you subsequence of rows
-    Mat batch_t = {
-        .rows = size,
-        .cols = t.cols,
-        .elements = &MAT_AT(t, b->begin, 0),
+    // Every worker starts with an equal contiguous share of the range
+    size_t n = end - begin;
+    for (size_t i = 0; i < nn__pool.count; ++i) {
+        nn__pool.slots[i].begin = begin + n*i/nn__pool.count;
+        nn__pool.slots[i].end = begin + n*(i + 1)/nn__pool.count;
+    }
+
+    Nn_Parallel_For pf = {
+        .grain = grain,
+        .task = task,
+        .arg = arg,
     };
+    nn__pool_dispatch(nn__parallel_for_task, &pf);
+    pthread_mutex_unlock(&nn__pool.run);
+}
+#else
+void nn_threads_set_count(size_t count)
+{
+    (void) count;
+}
 
-    NN g = nn_backprop(r, nn, batch_t);
-    nn_learn(nn, g, rate);
-    b->cost += nn_cost(nn, batch_t);
-    b->begin += batch_size;
+size_t nn_threads_count(void)
+{
+    return 1;
+}
 
-    if (b->begin >= t.rows) {
-        size_t batch_count = (t.rows + batch_size - 1)/batch_size;
-        b->cost /= batch_count;
-        b->finished = true;
+void nn_threads_run(Nn_Task task, void *arg)
+{
+    task(arg, 0);
+}
+
+void nn_parallel_for(size_t begin, size_t end, size_t grain, Nn_Range_Task task, void *arg)
+{
+    if (grain == 0) grain = 1;
+    for (size_t i = begin; i < end; i += grain) {
+        task(arg, i, end - i < grain ? end : i + grain, 0);
     }
 }
+#endif // NN_THREADS
 
-Region region_alloc_alloc(size_t capacity_bytes)
+// d = s*d*dactf(y) for every element
+static void nn__delta(Mat d, Mat y, float s)
 {
-    Region r = {0};
+    NN_ASSERT(d.rows == y.rows);
+    NN_ASSERT(d.cols == y.cols);
+    Nn_Dact_Row dact = nn__dact_row(NN_ACT);
+    for (size_t i = 0; i < d.rows; ++i) {
+        dact(&MAT_AT(d, i, 0), &MAT_AT(y, i, 0), d.cols, s);
+    }
+}
 
-    size_t word_size = sizeof(*r.words);
-    size_t capacity_words = (capacity_bytes + word_size - 1)/word_size;
+// Per worker scratch memory of nn_backprop for a chunk of n rows:
+//   as[l] - n x arch[l] activations of layer l
+//   ds    - two n x max(arch) buffers for the derivatives of the cost by
+//           the activations of a layer, turned in place into its deltas
+struct Nn_Backprop_Scratch {
+    Mat *as;
+    float *ds[2];
+};
 
-    void *words = NN_MALLOC(capacity_words*word_size);
-    NN_ASSERT(words != NULL);
-    r.capacity = capacity_words;
-    r.words = words;
-    return r;
+static size_t nn__backprop_scratch_bytes(size_t *arch, size_t arch_count, size_t n)
+{
+    size_t bytes = region_footprint(sizeof(Mat)*arch_count);
+    size_t width = 0;
+    for (size_t l = 0; l < arch_count; ++l) {
+        if (l > 0) bytes += region_footprint(sizeof(float)*n*arch[l]);
+        if (width < arch[l]) width = arch[l];
+    }
+    return bytes + 2*region_footprint(sizeof(float)*n*width);
 }
 
-void *region_alloc(Region *r, size_t size_bytes)
+static Nn_Backprop_Scratch nn__backprop_scratch_alloc(Region *r, NN nn, size_t n)
 {
-    if (r == NULL) return NN_MALLOC(size_bytes);
-    size_t word_size = sizeof(*r->words);
-    size_t size_words = (size_bytes + word_size - 1)/word_size;
+    Nn_Backprop_Scratch bs;
+    size_t width = 0;
+    bs.as = region_alloc(r, sizeof(*bs.as)*nn.arch_count);
+    NN_ASSERT(bs.as != NULL);
+    // as[0] is a view of the inputs, so it's never allocated
+    for (size_t l = 0; l < nn.arch_count; ++l) {
+        if (l > 0) bs.as[l] = mat_alloc(r, n, nn.arch[l]);
+        if (width < nn.arch[l]) width = nn.arch[l];
+    }
+    for (size_t i = 0; i < 2; ++i) {
+        bs.ds[i] = region_alloc(r, sizeof(float)*n*width);
+        NN_ASSERT(bs.ds[i] != NULL);
+    }
+    return bs;
+}
 
-    NN_ASSERT(r->size + size_words <= r->capacity);
-    if (r->size + size_words > r->capacity) return NULL;
-    void *result = &r->words[r->size];
-    r->size += size_words;
-    return result;
+// Overwrites g with the gradient summed (not averaged) over all the rows of t
+// and returns the sum of the squared errors of the rows, which the output
+// derivatives need anyway
+static float nn__backprop_rows(NN nn, NN g, Mat t, Nn_Backprop_Scratch bs)
+{
+    size_t n = t.rows;
+    Mat *as = bs.as;
+    for (size_t l = 1; l < nn.arch_count; ++l) {
+        as[l].rows = n;
+    }
+
+    // The input half of t goes straight into the first layer
+    as[0] = mat_slice_cols(t, 0, nn.arch[0]);
+    Mat y = mat_slice_cols(t, nn.arch[0], nn.arch[nn.arch_count-1]);
+    for (size_t l = 0; l < nn.arch_count-1; ++l) {
+        mat_dense(as[l+1], as[l], nn.ws[l], nn.bs[l], NN_ACT);
+    }
+
+    size_t cur = 0;
+    Mat d = {
+        .rows = n,
+        .cols = nn.arch[nn.arch_count-1],
+        .stride = nn.arch[nn.arch_count-1],
+        .elements = bs.ds[cur],
+    };
+    float c = 0;
+    for (size_t i = 0; i < n; ++i) {
+        for (size_t j = 0; j < d.cols; ++j) {
+            float e = MAT_AT(as[nn.arch_count-1], i, j) - MAT_AT(y, i, j);
+            c += e*e;
+#ifdef NN_BACKPROP_TRADITIONAL
+            MAT_AT(d, i, j) = 2*e;
+#else
+            MAT_AT(d, i, j) = e;
+#endif // NN_BACKPROP_TRADITIONAL
+        }
+    }
+
+#ifdef NN_BACKPROP_TRADITIONAL
+    float q = 1;
+#else
+    float q = 2;
+#endif // NN_BACKPROP_TRADITIONAL
+
+    for (size_t l = nn.arch_count-1; l > 0; --l) {
+        nn__delta(d, as[l], q);
+        mat_dot_at(g.ws[l-1], as[l-1], d);
+        row_fill(g.bs[l-1], 0);
+        for (size_t i = 0; i < n; ++i) {
+            mat_sum(row_as_mat(g.bs[l-1]), row_as_mat(mat_row(d, i)));
+        }
+        if (l > 1) {
+            cur = 1 - cur;
+            Mat pd = {
+                .rows = n,
+                .cols = nn.arch[l-1],
+                .stride = nn.arch[l-1],
+                .elements = bs.ds[cur],
+            };
+            mat_dot_bt(pd, d, nn.ws[l-1]);
+            d = pd;
+        }
+    }
+
+    return c;
+}
+
+// dst += src over all the weights and biases
+static void nn__add(NN dst, NN src)
+{
+    NN_ASSERT(dst.params_count == src.params_count);
+    for (size_t i = 0; i < dst.params_count; ++i) {
+        dst.params[i] += src.params[i];
+    }
+}
+
+typedef struct {
+    Workspace *ws;
+    NN nn;
+    Mat t;
+    size_t workers;
+    size_t stride;
+} Nn_Backprop_Ctx;
+
+static void nn__backprop_task(void *arg, size_t worker)
+{
+    Nn_Backprop_Ctx *ctx = arg;
+    if (worker >= ctx->workers) return;
+    size_t begin = ctx->t.rows*worker/ctx->workers;
+    size_t end = ctx->t.rows*(worker + 1)/ctx->workers;
+    Mat t = mat_slice_rows(ctx->t, begin, end - begin);
+    ctx->ws->costs[worker] = nn__backprop_rows(ctx->nn, ctx->ws->gs[worker], t, ctx->ws->scratch[worker]);
+}
+
+// One level of the tree reduction: gs[i] += gs[i + stride] for every i that
+// is a multiple of 2*stride
+static void nn__backprop_reduce_task(void *arg, size_t worker)
+{
+    Nn_Backprop_Ctx *ctx = arg;
+    if (worker%(2*ctx->stride) != 0) return;
+    if (worker + ctx->stride >= ctx->workers) return;
+    nn__add(ctx->ws->gs[worker], ctx->ws->gs[worker + ctx->stride]);
+}
+
+static size_t nn__backprop_workers(size_t n)
+{
+    size_t workers = n/NN_BACKPROP_MIN_ROWS;
+    if (workers > nn_threads_count()) workers = nn_threads_count();
+    if (workers < 1) workers = 1;
+    return workers;
+}
+
+// Every worker gets its own chunk of rows, scratch and gradient. The
+// gradient of worker 0 is the result, so with a single worker nothing needs
+// to be reduced. If g is not NULL it becomes that gradient instead of a
+// freshly allocated one.
+static Workspace nn__workspace_alloc(Region *r, size_t *arch, size_t arch_count, size_t rows, const NN *g)
+{
+    Workspace ws = {
+        .arch = arch,
+        .arch_count = arch_count,
+        .rows = rows,
+        .workers = nn__backprop_workers(rows),
+    };
+    ws.gs = region_alloc(r, sizeof(*ws.gs)*ws.workers);
+    NN_ASSERT(ws.gs != NULL);
+    ws.costs = region_alloc(r, sizeof(*ws.costs)*ws.workers);
+    NN_ASSERT(ws.costs != NULL);
+    ws.scratch = region_alloc(r, sizeof(*ws.scratch)*ws.workers);
+    NN_ASSERT(ws.scratch != NULL);
+    for (size_t i = 0; i < ws.workers; ++i) {
+        ws.gs[i] = (i == 0 && g != NULL) ? *g : nn__alloc(r, arch, arch_count, false, NULL);
+        ws.scratch[i] = nn__backprop_scratch_alloc(r, ws.gs[i], (rows + ws.workers - 1)/ws.workers);
+    }
+    return ws;
+}
+
+Workspace workspace_alloc(Region *r, size_t *arch, size_t arch_count, size_t rows)
+{
+    NN_ASSERT(rows > 0);
+    Workspace ws = nn__workspace_alloc(r, arch, arch_count, rows, NULL);
+    ws.batch = mat_alloc(r, rows, arch[0] + arch[arch_count - 1]);
+    return ws;
+}
+
+NN nn_backprop_ws(Workspace *ws, NN nn, Mat t, float *cost)
+{
+    size_t n = t.rows;
+    NN_ASSERT(nn.arch[0] + nn.arch[nn.arch_count-1] == t.cols);
+    NN_ASSERT(nn.params_count == ws->gs[0].params_count);
+    NN_ASSERT(n <= ws->rows);
+    NN_ASSERT(ws->workers <= nn_threads_count() && "nn_threads_set_count() went down after workspace_alloc()");
+
+    // Smaller batches (e.g. the last one of an epoch) go to just enough
+    // workers to keep every chunk within what its scratch was sized for
+    size_t chunk = (ws->rows + ws->workers - 1)/ws->workers;
+    Nn_Backprop_Ctx ctx = {
+        .ws = ws,
+        .nn = nn,
+        .t = t,
+        .workers = n > 0 ? (n + chunk - 1)/chunk : 1,
+    };
+
+    if (ctx.workers == 1) {
+        nn__backprop_task(&ctx, 0);
+    } else {
+        nn_threads_run(nn__backprop_task, &ctx);
+        for (ctx.stride = 1; ctx.stride < ctx.workers; ctx.stride *= 2) {
+            nn_threads_run(nn__backprop_reduce_task, &ctx);
+        }
+    }
+
+    NN g = ws->gs[0];
+    if (cost) {
+        float c = 0;
+        for (size_t i = 0; i < ctx.workers; ++i) c += ws->costs[i];
+        *cost = c/n;
+    }
+    for (size_t i = 0; i < g.params_count; ++i) {
+        g.params[i] /= n;
+    }
+
+    return g;
+}
+
+NN nn_backprop(Region *r, NN nn, Mat t, float *cost)
+{
+    NN g = nn__alloc(r, nn.arch, nn.arch_count, false, NULL);
+    size_t s = region_save(r);
+    Workspace ws = nn__workspace_alloc(r, nn.arch, nn.arch_count, t.rows, &g);
+    nn_backprop_ws(&ws, nn, t, cost);
+    region_rewind(r, s);
+    return g;
+}
+
+NN nn_finite_diff(Region *r, NN nn, Mat t, float eps)
+{
+    float saved;
+    float c = nn_cost(r, nn, t);
+
+    NN g = nn_alloc(r, nn.arch, nn.arch_count);
+
+    for (size_t i = 0; i < nn.params_count; ++i) {
+        saved = nn.params[i];
+        nn.params[i] += eps;
+        g.params[i] = (nn_cost(r, nn, t) - c)/eps;
+        nn.params[i] = saved;
+    }
+
+    return g;
+}
+
+void nn_learn(NN nn, NN g, float rate)
+{
+    NN_ASSERT(nn.params_count == g.params_count);
+    for (size_t i = 0; i < nn.params_count; ++i) {
+        nn.params[i] -= rate*g.params[i];
+    }
+}
+
+Optimizer optimizer_alloc(Region *r, NN nn, Opt kind, float rate)
+{
+    Optimizer opt = {
+        .kind = kind,
+        .rate = rate,
+        .beta1 = 0.9f,
+        .beta2 = kind == OPT_RMSPROP ? 0.9f : 0.999f,
+        .eps = 1e-8f,
+        .count = nn.params_count,
+    };
+    if (kind == OPT_MOMENTUM || kind == OPT_ADAM) {
+        opt.m = nn__alloc_aligned(r, sizeof(*opt.m)*opt.count, NN_PARAMS_ALIGNMENT);
+        NN_ASSERT(opt.m != NULL);
+    }
+    if (kind == OPT_RMSPROP || kind == OPT_ADAM) {
+        opt.v = nn__alloc_aligned(r, sizeof(*opt.v)*opt.count, NN_PARAMS_ALIGNMENT);
+        NN_ASSERT(opt.v != NULL);
+    }
+    optimizer_reset(&opt);
+    return opt;
+}
+
+void optimizer_reset(Optimizer *opt)
+{
+    opt->steps = 0;
+    if (opt->m) memset(opt->m, 0, sizeof(*opt->m)*opt->count);
+    if (opt->v) memset(opt->v, 0, sizeof(*opt->v)*opt->count);
+}
+
+// Everything a single step needs, with the per step scalars (like the bias
+// correction of Adam folded into rate) already computed
+typedef struct {
+    Opt kind;
+    float rate;
+    float beta1;
+    float beta2;
+    float eps;
+    float *p;
+    const float *g;
+    float *m;
+    float *v;
+} Nn_Opt_Step;
+
+static void nn__opt_step_scalar(const Nn_Opt_Step *s, size_t begin, size_t end)
+{
+    float *p = s->p, *m = s->m, *v = s->v;
+    const float *g = s->g;
+    switch (s->kind) {
+    case OPT_SGD:
+        for (size_t i = begin; i < end; ++i) p[i] -= s->rate*g[i];
+        break;
+    case OPT_MOMENTUM:
+        for (size_t i = begin; i < end; ++i) {
+            m[i] = s->beta1*m[i] + g[i];
+            p[i] -= s->rate*m[i];
+        }
+        break;
+    case OPT_RMSPROP:
+        for (size_t i = begin; i < end; ++i) {
+            v[i] = s->beta2*v[i] + (1 - s->beta2)*g[i]*g[i];
+            p[i] -= s->rate*g[i]/(sqrtf(v[i]) + s->eps);
+        }
+        break;
+    case OPT_ADAM:
+        for (size_t i = begin; i < end; ++i) {
+            m[i] = s->beta1*m[i] + (1 - s->beta1)*g[i];
+            v[i] = s->beta2*v[i] + (1 - s->beta2)*g[i]*g[i];
+            p[i] -= s->rate*m[i]/(sqrtf(v[i]) + s->eps);
+        }
+        break;
+    default:
+        NN_ASSERT(0 && "Unreachable");
+    }
+}
+
+#ifdef NN_SIMD_X86
+// Same formulas as nn__opt_step_scalar() 8 parameters at a time. kind is
+// always a compile time constant after inlining.
+__attribute__((target("avx2,fma"), always_inline))
+static inline void nn__opt_step8_avx2(const Opt kind, const Nn_Opt_Step *s, size_t i, __m256i mask, bool full)
+{
+    const __m256 rate = _mm256_set1_ps(s->rate);
+    const __m256 b1 = _mm256_set1_ps(s->beta1);
+    const __m256 b2 = _mm256_set1_ps(s->beta2);
+    const __m256 eps = _mm256_set1_ps(s->eps);
+    const __m256 one = _mm256_set1_ps(1.f);
+#define NN__LOAD(xs)     (full ? _mm256_loadu_ps(&(xs)[i]) : _mm256_maskload_ps(&(xs)[i], mask))
+#define NN__STORE(xs, x) (full ? _mm256_storeu_ps(&(xs)[i], x) : _mm256_maskstore_ps(&(xs)[i], mask, x))
+    __m256 p = NN__LOAD(s->p);
+    __m256 g = NN__LOAD(s->g);
+    switch (kind) {
+    case OPT_SGD:
+        p = _mm256_fnmadd_ps(rate, g, p);
+        break;
+    case OPT_MOMENTUM: {
+        __m256 m = _mm256_fmadd_ps(b1, NN__LOAD(s->m), g);
+        NN__STORE(s->m, m);
+        p = _mm256_fnmadd_ps(rate, m, p);
+    } break;
+    case OPT_RMSPROP: {
+        __m256 v = _mm256_mul_ps(b2, NN__LOAD(s->v));
+        v = _mm256_fmadd_ps(_mm256_sub_ps(one, b2), _mm256_mul_ps(g, g), v);
+        NN__STORE(s->v, v);
+        __m256 d = _mm256_div_ps(g, _mm256_add_ps(_mm256_sqrt_ps(v), eps));
+        p = _mm256_fnmadd_ps(rate, d, p);
+    } break;
+    case OPT_ADAM: {
+        __m256 m = _mm256_mul_ps(b1, NN__LOAD(s->m));
+        m = _mm256_fmadd_ps(_mm256_sub_ps(one, b1), g, m);
+        __m256 v = _mm256_mul_ps(b2, NN__LOAD(s->v));
+        v = _mm256_fmadd_ps(_mm256_sub_ps(one, b2), _mm256_mul_ps(g, g), v);
+        NN__STORE(s->m, m);
+        NN__STORE(s->v, v);
+        __m256 d = _mm256_div_ps(m, _mm256_add_ps(_mm256_sqrt_ps(v), eps));
+        p = _mm256_fnmadd_ps(rate, d, p);
+    } break;
+    }
+    NN__STORE(s->p, p);
+#undef NN__LOAD
+#undef NN__STORE
+}
+
+__attribute__((target("avx2,fma"), always_inline))
+static inline void nn__opt_steps_avx2(const Opt kind, const Nn_Opt_Step *s, size_t begin, size_t end)
+{
+    size_t i = begin;
+    for (; i + 8 <= end; i += 8) {
+        nn__opt_step8_avx2(kind, s, i, _mm256_setzero_si256(), true);
+    }
+    if (i < end) {
+        nn__opt_step8_avx2(kind, s, i, nn__mask8_avx2(end - i), false);
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static void nn__opt_step_avx2(const Nn_Opt_Step *s, size_t begin, size_t end)
+{
+    switch (s->kind) {
+    case OPT_SGD:      nn__opt_steps_avx2(OPT_SGD, s, begin, end);      break;
+    case OPT_MOMENTUM: nn__opt_steps_avx2(OPT_MOMENTUM, s, begin, end); break;
+    case OPT_RMSPROP:  nn__opt_steps_avx2(OPT_RMSPROP, s, begin, end);  break;
+    case OPT_ADAM:     nn__opt_steps_avx2(OPT_ADAM, s, begin, end);     break;
+    default:           NN_ASSERT(0 && "Unreachable");
+    }
+}
+#endif // NN_SIMD_X86
+
+static void nn__opt_step_task(void *arg, size_t begin, size_t end, size_t worker)
+{
+    (void) worker;
+    const Nn_Opt_Step *s = arg;
+#ifdef NN_SIMD_X86
+    if (nn__has_avx2()) {
+        nn__opt_step_avx2(s, begin, end);
+        return;
+    }
+#endif // NN_SIMD_X86
+    nn__opt_step_scalar(s, begin, end);
+}
+
+void optimizer_step(Optimizer *opt, NN nn, NN g)
+{
+    NN_ASSERT(opt->count == nn.params_count);
+    NN_ASSERT(g.params_count == nn.params_count);
+
+    opt->steps += 1;
+    Nn_Opt_Step s = {
+        .kind = opt->kind,
+        .rate = opt->rate,
+        .beta1 = opt->beta1,
+        .beta2 = opt->beta2,
+        .eps = opt->eps,
+        .p = nn.params,
+        .g = g.params,
+        .m = opt->m,
+        .v = opt->v,
+    };
+    if (opt->kind == OPT_ADAM) {
+        float c1 = 1 - powf(opt->beta1, (float) opt->steps);
+        float c2 = 1 - powf(opt->beta2, (float) opt->steps);
+        s.rate *= sqrtf(c2)/c1;
+    }
+
+    nn_parallel_for(0, opt->count, NN_PARALLEL_MIN_WORK, nn__opt_step_task, &s);
+}
+
+void mat_shuffle_rows(Mat m)
+{
+    for (size_t i = 0; i < m.rows; ++i) {
+         size_t j = i + rand()%(m.rows - i);
+         if (i != j) {
+             for (size_t k = 0; k < m.cols; ++k) {
+                 float t = MAT_AT(m, i, k);
+                 MAT_AT(m, i, k) = MAT_AT(m, j, k);
+                 MAT_AT(m, j, k) = t;
+             }
+         }
+    }
+}
+
+void mat_gather_rows(Mat dst, Mat src, const size_t *rows)
+{
+    NN_ASSERT(dst.cols == src.cols);
+    for (size_t i = 0; i < dst.rows; ++i) {
+#if defined(__GNUC__) || defined(__clang__)
+        // The rows are all over the place, so the hardware prefetcher has
+        // no chance of guessing the next one. Every line of it is requested
+        // a few rows ahead instead.
+        if (i + NN_GATHER_PREFETCH < dst.rows) {
+            const char *next = (const char*) &MAT_AT(src, rows[i + NN_GATHER_PREFETCH], 0);
+            for (size_t k = 0; k < sizeof(float)*src.cols; k += 64) {
+                __builtin_prefetch(next + k, 0, 0);
+            }
+        }
+#endif
+        NN_ASSERT(rows[i] < src.rows);
+        memcpy(&MAT_AT(dst, i, 0), &MAT_AT(src, rows[i], 0), sizeof(float)*dst.cols);
+    }
+}
+
+void batch_order_alloc(Region *r, Batch *b, size_t rows_count)
+{
+    b->order = region_alloc(r, sizeof(*b->order)*rows_count);
+    NN_ASSERT(b->order != NULL);
+    b->order_count = rows_count;
+    for (size_t i = 0; i < rows_count; ++i) {
+        b->order[i] = i;
+    }
+    b->rng = ((uint64_t) rand() << 32) ^ (uint64_t) rand();
+}
+
+// splitmix64, whose whole state is the single word in b->rng
+static uint64_t nn__rand64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ull);
+    z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27))*0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+void batch_shuffle(Batch *b)
+{
+    for (size_t i = 0; i < b->order_count; ++i) {
+        size_t j = i + nn__rand64(&b->rng)%(b->order_count - i);
+        size_t t = b->order[i];
+        b->order[i] = b->order[j];
+        b->order[j] = t;
+    }
+}
+
+void batch_process(Workspace *ws, Batch *b, NN nn, Mat t, Optimizer *opt)
+{
+    if (b->finished) {
+        b->finished = false;
+        b->begin = 0;
+        b->cost = 0;
+    }
+
+    size_t batch_size = ws->rows;
+    size_t size = batch_size;
+    if (b->begin + batch_size >= t.rows)  {
+        size = t.rows - b->begin;
+    }
+
+    Mat batch_t;
+    if (b->order) {
+        NN_ASSERT(b->order_count == t.rows);
+        NN_ASSERT(ws->batch.cols == t.cols);
+        batch_t = mat_slice_rows(ws->batch, 0, size);
+        mat_gather_rows(batch_t, t, &b->order[b->begin]);
+    } else {
+        batch_t = mat_slice_rows(t, b->begin, size);
+    }
+
+    // The cost comes out of the forward pass of the backprop, so it's the
+    // cost of the batch right before the step rather than after it
+    float c;
+    NN g = nn_backprop_ws(ws, nn, batch_t, &c);
+    optimizer_step(opt, nn, g);
+    b->cost += c;
+    b->begin += batch_size;
+
+    if (b->begin >= t.rows) {
+        size_t batch_count = (t.rows + batch_size - 1)/batch_size;
+        b->cost /= batch_count;
+        b->finished = true;
+    }
+}
+
+static size_t nn__alloc_bytes(size_t *arch, size_t arch_count, bool activations)
+{
+    NN_ASSERT(arch_count > 0);
+    size_t bytes = region_footprint(sizeof(Mat)*(arch_count - 1)) +
+                   region_footprint(sizeof(Row)*(arch_count - 1)) +
+                   region_footprint(sizeof(float)*nn_params_count(arch, arch_count));
+    if (activations) {
+        bytes += region_footprint(sizeof(Row)*arch_count);
+        for (size_t l = 0; l < arch_count; ++l) {
+            bytes += region_footprint(sizeof(float)*arch[l]);
+        }
+    }
+    return bytes;
+}
+
+size_t nn_alloc_bytes(size_t *arch, size_t arch_count)
+{
+    return nn__alloc_bytes(arch, arch_count, true);
+}
+
+size_t optimizer_alloc_bytes(size_t *arch, size_t arch_count, Opt kind)
+{
+    size_t state = region_footprint(sizeof(float)*nn_params_count(arch, arch_count));
+    switch (kind) {
+    case OPT_SGD:      return 0;
+    case OPT_MOMENTUM: return state;
+    case OPT_RMSPROP:  return state;
+    case OPT_ADAM:     return 2*state;
+    }
+    NN_ASSERT(0 && "Unreachable");
+    return 0;
+}
+
+size_t batch_order_alloc_bytes(size_t rows_count)
+{
+    return region_footprint(sizeof(size_t)*rows_count);
+}
+
+size_t nn_forward_batch_bytes(size_t *arch, size_t arch_count, size_t rows)
+{
+    if (arch_count == 1) return 0;
+    size_t width = 0;
+    for (size_t l = 1; l + 1 < arch_count; ++l) {
+        if (width < arch[l]) width = arch[l];
+    }
+    return 2*region_footprint(sizeof(float)*rows*width);
+}
+
+size_t nn_freeze_bytes(size_t *arch, size_t arch_count)
+{
+    return region_footprint(region_footprint(sizeof(*arch)*arch_count) +
+                            sizeof(float)*nn_params_count(arch, arch_count));
+}
+
+size_t nn_forward_bytes(size_t *arch, size_t arch_count, size_t rows)
+{
+    return region_footprint(sizeof(float)*rows*arch[arch_count - 1]) +
+           nn_forward_batch_bytes(arch, arch_count, rows);
+}
+
+size_t nn_cost_bytes(size_t *arch, size_t arch_count, size_t rows)
+{
+    size_t width;
+    size_t grain = nn__cost_grain(arch, arch_count, rows, &width);
+    size_t workers = nn_threads_count();
+    return region_footprint(sizeof(float)*workers) +
+           region_footprint(sizeof(Region)*workers) +
+           workers*region_sub_bytes(nn__cost_scratch_bytes(arch, arch_count, grain, width));
+}
+
+// Workspace without the batch, with its own gradient for worker 0
+static size_t nn__workspace_bytes(size_t *arch, size_t arch_count, size_t rows)
+{
+    size_t workers = nn__backprop_workers(rows);
+    size_t chunk = (rows + workers - 1)/workers;
+    return workers*nn__alloc_bytes(arch, arch_count, false) +
+           region_footprint(sizeof(NN)*workers) +
+           region_footprint(sizeof(float)*workers) +
+           region_footprint(sizeof(Nn_Backprop_Scratch)*workers) +
+           workers*nn__backprop_scratch_bytes(arch, arch_count, chunk);
+}
+
+size_t nn_backprop_bytes(size_t *arch, size_t arch_count, size_t rows)
+{
+    // The workspace borrows the returned gradient rather than allocating one
+    return nn__workspace_bytes(arch, arch_count, rows);
+}
+
+size_t workspace_alloc_bytes(size_t *arch, size_t arch_count, size_t rows)
+{
+    return nn__workspace_bytes(arch, arch_count, rows) +
+           region_footprint(sizeof(float)*rows*(arch[0] + arch[arch_count - 1]));
+}
+
+// Optimizer section of a checkpoint, followed by count floats of m and then
+// count floats of v, each one only if the optimizer has it
+typedef struct {
+    uint32_t kind;
+    float rate;
+    float beta1;
+    float beta2;
+    float eps;
+    uint32_t reserved;
+    uint64_t steps;
+    uint64_t count;
+} Nn_File_Opt;
+
+// Training section of a checkpoint: the epoch and the Batch, followed by
+// order_count uint64_t of Batch.order
+typedef struct {
+    uint64_t epoch;
+    uint64_t begin;
+    uint64_t rng;
+    uint64_t order_count;
+    float cost;
+    uint32_t finished;
+} Nn_File_Train;
+
+#define NN_FILE_TAG_OPT "opt"
+#define NN_FILE_TAG_TRAIN "trn"
+
+typedef struct {
+    float *params;
+    Optimizer opt;
+    Batch batch;
+    size_t epoch;
+    size_t index;   // The n of <prefix>-<n>.nn
+} Nn_Snapshot;
+
+struct Checkpoint {
+    const char *prefix;
+    size_t keep;
+    size_t *arch;
+    size_t arch_count;
+    size_t params_count;
+    bool has_opt;
+    bool has_batch;
+    size_t saved;   // Amount of snapshots taken so far
+    Nn_Snapshot snapshots[2];
+    // Scratch for the file names, only touched by the writer
+    char *path;
+    char *tmp_path;
+#ifdef NN_THREADS
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    Nn_Snapshot *pending; // Waiting for the writer
+    Nn_Snapshot *writing; // Being written right now
+    bool quit;
+#endif // NN_THREADS
+};
+
+static void nn__checkpoint_path(const Checkpoint *cp, char *path, size_t index, const char *suffix)
+{
+    sprintf(path, "%s-%06zu.nn%s", cp->prefix, index, suffix);
+}
+
+// A renamed file only survives a crash once the directory it's in is synced too
+static void nn__fsync_dir(const char *path)
+{
+#ifdef NN_REGION_MMAP
+    const char *slash = strrchr(path, '/');
+    char dir[4096] = ".";
+    if (slash != NULL) {
+        size_t n = slash - path;
+        if (n == 0) n = 1;
+        if (n >= sizeof(dir)) return;
+        memcpy(dir, path, n);
+        dir[n] = '\0';
+    }
+    int fd = open(dir, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    close(fd);
+#else
+    (void) path;
+#endif // NN_REGION_MMAP
+}
+
+static bool nn__file_write_opt(FILE *f, const Optimizer *opt)
+{
+    Nn_File_Opt header = {
+        .kind = opt->kind,
+        .rate = opt->rate,
+        .beta1 = opt->beta1,
+        .beta2 = opt->beta2,
+        .eps = opt->eps,
+        .steps = opt->steps,
+        .count = opt->count,
+    };
+    size_t size = sizeof(header) +
+                  (opt->m ? sizeof(*opt->m)*opt->count : 0) +
+                  (opt->v ? sizeof(*opt->v)*opt->count : 0);
+    bool ok = nn__file_section(f, NN_FILE_TAG_OPT, size) && fwrite(&header, sizeof(header), 1, f) == 1;
+    if (ok && opt->m) ok = fwrite(opt->m, sizeof(*opt->m), opt->count, f) == opt->count;
+    if (ok && opt->v) ok = fwrite(opt->v, sizeof(*opt->v), opt->count, f) == opt->count;
+    return ok && nn__file_pad(f, size);
+}
+
+static bool nn__file_write_train(FILE *f, const Batch *b, size_t epoch)
+{
+    Nn_File_Train header = {
+        .epoch = epoch,
+        .begin = b->begin,
+        .rng = b->rng,
+        .order_count = b->order_count,
+        .cost = b->cost,
+        .finished = b->finished,
+    };
+    size_t size = sizeof(header) + sizeof(uint64_t)*b->order_count;
+    bool ok = nn__file_section(f, NN_FILE_TAG_TRAIN, size) && fwrite(&header, sizeof(header), 1, f) == 1;
+    if (sizeof(*b->order) == sizeof(uint64_t)) {
+        ok = ok && fwrite(b->order, sizeof(*b->order), b->order_count, f) == b->order_count;
+    } else {
+        for (size_t i = 0; ok && i < b->order_count; ++i) {
+            uint64_t x = b->order[i];
+            ok = fwrite(&x, sizeof(x), 1, f) == 1;
+        }
+    }
+    return ok && nn__file_pad(f, size);
+}
+
+static bool nn__checkpoint_write(Checkpoint *cp, const Nn_Snapshot *snap)
+{
+    nn__checkpoint_path(cp, cp->path, snap->index, "");
+    nn__checkpoint_path(cp, cp->tmp_path, snap->index, ".tmp");
+
+    FILE *f = fopen(cp->tmp_path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", cp->tmp_path, strerror(errno));
+        return false;
+    }
+
+    bool ok = nn__file_write_model(f, cp->arch, cp->arch_count, snap->params, cp->params_count);
+    if (ok && cp->has_opt) ok = nn__file_write_opt(f, &snap->opt);
+    // The epoch is always there, the Batch in it is empty if there was none
+    ok = ok && nn__file_write_train(f, &snap->batch, snap->epoch);
+    ok = ok && fflush(f) == 0;
+#ifdef NN_REGION_MMAP
+    ok = ok && fsync(fileno(f)) == 0;
+#endif // NN_REGION_MMAP
+    if (fclose(f) != 0) ok = false;
+    ok = ok && rename(cp->tmp_path, cp->path) == 0;
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not write %s: %s\n", cp->path, strerror(errno));
+        remove(cp->tmp_path);
+        return false;
+    }
+    nn__fsync_dir(cp->path);
+
+    if (snap->index >= cp->keep) {
+        nn__checkpoint_path(cp, cp->path, snap->index - cp->keep, "");
+        remove(cp->path);
+    }
+    return true;
+}
+
+static void nn__checkpoint_copy(const Checkpoint *cp, Nn_Snapshot *snap, NN nn, const Optimizer *opt, const Batch *b, size_t epoch)
+{
+    NN_ASSERT(nn.params_count == cp->params_count);
+    memcpy(snap->params, nn.params, sizeof(*nn.params)*nn.params_count);
+    snap->epoch = epoch;
+
+    if (cp->has_opt) {
+        NN_ASSERT(opt != NULL);
+        NN_ASSERT(opt->count == snap->opt.count);
+        NN_ASSERT((opt->m == NULL) == (snap->opt.m == NULL));
+        NN_ASSERT((opt->v == NULL) == (snap->opt.v == NULL));
+        float *m = snap->opt.m;
+        float *v = snap->opt.v;
+        snap->opt = *opt;
+        snap->opt.m = m;
+        snap->opt.v = v;
+        if (m) memcpy(m, opt->m, sizeof(*m)*opt->count);
+        if (v) memcpy(v, opt->v, sizeof(*v)*opt->count);
+    }
+
+    if (cp->has_batch) {
+        NN_ASSERT(b != NULL);
+        NN_ASSERT(b->order_count == snap->batch.order_count);
+        size_t *order = snap->batch.order;
+        snap->batch = *b;
+        snap->batch.order = order;
+        if (order) memcpy(order, b->order, sizeof(*order)*b->order_count);
+    }
+}
+
+#ifdef NN_THREADS
+static void *nn__checkpoint_writer(void *arg)
+{
+    Checkpoint *cp = arg;
+    pthread_mutex_lock(&cp->mutex);
+    for (;;) {
+        while (cp->pending == NULL && !cp->quit) {
+            pthread_cond_wait(&cp->cond, &cp->mutex);
+        }
+        // Whatever is pending still gets written before quitting
+        if (cp->pending == NULL) break;
+        cp->writing = cp->pending;
+        cp->pending = NULL;
+        pthread_mutex_unlock(&cp->mutex);
+
+        nn__checkpoint_write(cp, cp->writing);
+
+        pthread_mutex_lock(&cp->mutex);
+        cp->writing = NULL;
+    }
+    pthread_mutex_unlock(&cp->mutex);
+    return NULL;
+}
+#endif // NN_THREADS
+
+Checkpoint *checkpoint_alloc(Region *r, const char *prefix, size_t keep, NN nn, const Optimizer *opt, const Batch *b)
+{
+    NN_ASSERT(keep > 0);
+    Checkpoint *cp = region_alloc(r, sizeof(*cp));
+    NN_ASSERT(cp != NULL);
+    memset(cp, 0, sizeof(*cp));
+    cp->prefix = prefix;
+    cp->keep = keep;
+    cp->arch = nn.arch;
+    cp->arch_count = nn.arch_count;
+    cp->params_count = nn.params_count;
+    cp->has_opt = opt != NULL;
+    cp->has_batch = b != NULL;
+
+    size_t path_size = strlen(prefix) + 32;
+    cp->path = region_alloc(r, path_size);
+    NN_ASSERT(cp->path != NULL);
+    cp->tmp_path = region_alloc(r, path_size);
+    NN_ASSERT(cp->tmp_path != NULL);
+
+    for (size_t i = 0; i < 2; ++i) {
+        Nn_Snapshot *snap = &cp->snapshots[i];
+        snap->params = nn__alloc_aligned(r, sizeof(*snap->params)*nn.params_count, NN_PARAMS_ALIGNMENT);
+        NN_ASSERT(snap->params != NULL);
+        if (opt != NULL) {
+            snap->opt.count = opt->count;
+            if (opt->m) {
+                snap->opt.m = nn__alloc_aligned(r, sizeof(*snap->opt.m)*opt->count, NN_PARAMS_ALIGNMENT);
+                NN_ASSERT(snap->opt.m != NULL);
+            }
+            if (opt->v) {
+                snap->opt.v = nn__alloc_aligned(r, sizeof(*snap->opt.v)*opt->count, NN_PARAMS_ALIGNMENT);
+                NN_ASSERT(snap->opt.v != NULL);
+            }
+        }
+        if (b != NULL && b->order != NULL) {
+            snap->batch.order = region_alloc(r, sizeof(*snap->batch.order)*b->order_count);
+            NN_ASSERT(snap->batch.order != NULL);
+            snap->batch.order_count = b->order_count;
+        }
+    }
+
+#ifdef NN_THREADS
+    pthread_mutex_init(&cp->mutex, NULL);
+    pthread_cond_init(&cp->cond, NULL);
+    int ret = pthread_create(&cp->thread, NULL, nn__checkpoint_writer, cp);
+    NN_ASSERT(ret == 0);
+#endif // NN_THREADS
+
+    return cp;
+}
+
+void checkpoint_save(Checkpoint *cp, NN nn, const Optimizer *opt, const Batch *b, size_t epoch)
+{
+#ifdef NN_THREADS
+    // The copy is done under the lock, so the writer can't pick the snapshot
+    // up halfway through. It's just a memcpy of the parameters, which the
+    // writer only waits for between the files.
+    pthread_mutex_lock(&cp->mutex);
+    Nn_Snapshot *snap = &cp->snapshots[0];
+    if (snap == cp->writing) snap = &cp->snapshots[1];
+    nn__checkpoint_copy(cp, snap, nn, opt, b, epoch);
+    // A snapshot that never made it to the disk is just replaced, so the
+    // indices of the files stay consecutive for the rotation
+    if (snap != cp->pending) snap->index = cp->saved++;
+    cp->pending = snap;
+    pthread_cond_signal(&cp->cond);
+    pthread_mutex_unlock(&cp->mutex);
+#else
+    Nn_Snapshot *snap = &cp->snapshots[0];
+    nn__checkpoint_copy(cp, snap, nn, opt, b, epoch);
+    snap->index = cp->saved++;
+    nn__checkpoint_write(cp, snap);
+#endif // NN_THREADS
+}
+
+// Highest n below the given one of the existing <prefix>-<n>.nn. Only the
+// names nn__checkpoint_path() could have made count, so that no stray file
+// is mistaken for a checkpoint.
+static bool nn__checkpoint_latest(const Checkpoint *cp, size_t below, size_t *latest)
+{
+#ifdef NN_REGION_MMAP
+    const char *slash = strrchr(cp->prefix, '/');
+    const char *base = slash ? slash + 1 : cp->prefix;
+    size_t base_len = strlen(base);
+    char dir[4096] = ".";
+    if (slash != NULL) {
+        size_t n = slash - cp->prefix;
+        if (n == 0) n = 1;
+        if (n >= sizeof(dir)) return false;
+        memcpy(dir, cp->prefix, n);
+        dir[n] = '\0';
+    }
+
+    DIR *d = opendir(dir);
+    if (d == NULL) return false;
+    bool found = false;
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        const char *name = e->d_name;
+        if (strncmp(name, base, base_len) != 0 || name[base_len] != '-') continue;
+        const char *digits = name + base_len + 1;
+        size_t index = 0;
+        for (size_t i = 0; digits[i] >= '0' && digits[i] <= '9'; ++i) {
+            index = index*10 + (digits[i] - '0');
+        }
+        // Also rejects other paddings and the numbers that overflowed
+        char expected[32];
+        snprintf(expected, sizeof(expected), "%06zu.nn", index);
+        if (strcmp(digits, expected) != 0 || index >= below) continue;
+        if (!found || index > *latest) *latest = index;
+        found = true;
+    }
+    closedir(d);
+    return found;
+#else
+    // Nothing portable to list the files with
+    (void) cp;
+    (void) below;
+    (void) latest;
+    return false;
+#endif // NN_REGION_MMAP
+}
+
+Checkpoint_Resume checkpoint_resume(Checkpoint *cp, NN nn, Optimizer *opt, Batch *b, size_t *epoch)
+{
+    size_t latest;
+    if (!nn__checkpoint_latest(cp, SIZE_MAX, &latest)) return CHECKPOINT_NONE;
+
+#ifdef NN_THREADS
+    pthread_mutex_lock(&cp->mutex);
+    cp->saved = latest + 1;
+    pthread_mutex_unlock(&cp->mutex);
+#else
+    cp->saved = latest + 1;
+#endif // NN_THREADS
+
+    // cp->path belongs to the writer, which may already be busy
+    Region r = {0};
+    char *path = region_alloc(&r, strlen(cp->prefix) + 32);
+    NN_ASSERT(path != NULL);
+
+    // If the newest one doesn't load, fall back to the older ones, newest
+    // first, whatever gaps there are between them
+    Checkpoint_Resume result = CHECKPOINT_FAILED;
+    size_t index = latest;
+    do {
+        nn__checkpoint_path(cp, path, index, "");
+        if (checkpoint_load(path, nn, cp->has_opt ? opt : NULL, cp->has_batch ? b : NULL, epoch)) {
+            result = CHECKPOINT_RESUMED;
+            break;
+        }
+    } while (nn__checkpoint_latest(cp, index, &index));
+
+    region_free(&r);
+    return result;
+}
+
+void checkpoint_free(Checkpoint *cp)
+{
+#ifdef NN_THREADS
+    pthread_mutex_lock(&cp->mutex);
+    cp->quit = true;
+    pthread_cond_signal(&cp->cond);
+    pthread_mutex_unlock(&cp->mutex);
+    pthread_join(cp->thread, NULL);
+    pthread_cond_destroy(&cp->cond);
+    pthread_mutex_destroy(&cp->mutex);
+#else
+    (void) cp;
+#endif // NN_THREADS
+}
+
+static bool nn__file_check_opt(const char *file_path, const char *data, size_t size, const Optimizer *opt)
+{
+    Nn_File_Opt header;
+    if (size < sizeof(header)) {
+        fprintf(stderr, "ERROR: %s has a corrupted optimizer state\n", file_path);
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    size_t expected = sizeof(header) +
+                      (opt->m ? sizeof(*opt->m)*opt->count : 0) +
+                      (opt->v ? sizeof(*opt->v)*opt->count : 0);
+    if (header.kind != opt->kind || header.count != opt->count || size != expected) {
+        fprintf(stderr, "ERROR: %s was saved with a different optimizer\n", file_path);
+        return false;
+    }
+    return true;
+}
+
+static void nn__file_load_opt(const char *data, Optimizer *opt)
+{
+    Nn_File_Opt header;
+    memcpy(&header, data, sizeof(header));
+    opt->rate = header.rate;
+    opt->beta1 = header.beta1;
+    opt->beta2 = header.beta2;
+    opt->eps = header.eps;
+    opt->steps = header.steps;
+    data += sizeof(header);
+    if (opt->m) {
+        memcpy(opt->m, data, sizeof(*opt->m)*opt->count);
+        data += sizeof(*opt->m)*opt->count;
+    }
+    if (opt->v) memcpy(opt->v, data, sizeof(*opt->v)*opt->count);
+}
+
+static bool nn__file_check_train(const char *file_path, const char *data, size_t size, const Batch *b)
+{
+    Nn_File_Train header;
+    if (size < sizeof(header)) {
+        fprintf(stderr, "ERROR: %s has a corrupted training state\n", file_path);
+        return false;
+    }
+    memcpy(&header, data, sizeof(header));
+    // batch_process() goes on from begin, so it must be inside the order
+    // unless the batch finished the epoch, where begin may have run past it
+    bool unfinished_past_end = !header.finished && header.order_count > 0 && header.begin >= header.order_count;
+    if (header.finished > 1 || unfinished_past_end) {
+        fprintf(stderr, "ERROR: %s has a corrupted training state\n", file_path);
+        return false;
+    }
+    if (b == NULL) return true;
+    if (header.order_count != b->order_count || size - sizeof(header) != sizeof(uint64_t)*header.order_count) {
+        fprintf(stderr, "ERROR: %s was saved with a different amount of rows\n", file_path);
+        return false;
+    }
+    // batch_process() indexes the training data with these
+    for (size_t i = 0; i < header.order_count; ++i) {
+        uint64_t x;
+        memcpy(&x, data + sizeof(header) + sizeof(x)*i, sizeof(x));
+        if (x >= header.order_count) {
+            fprintf(stderr, "ERROR: %s has a corrupted training state\n", file_path);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void nn__file_load_train(const char *data, Batch *b, size_t *epoch)
+{
+    Nn_File_Train header;
+    memcpy(&header, data, sizeof(header));
+    if (epoch) *epoch = header.epoch;
+    if (b == NULL) return;
+    b->begin = header.begin;
+    b->cost = header.cost;
+    b->finished = header.finished;
+    b->rng = header.rng;
+    for (size_t i = 0; i < b->order_count; ++i) {
+        uint64_t x;
+        memcpy(&x, data + sizeof(header) + sizeof(x)*i, sizeof(x));
+        b->order[i] = x;
+    }
+}
+
+bool checkpoint_load(const char *file_path, NN nn, Optimizer *opt, Batch *b, size_t *epoch)
+{
+    Region r = {0};
+    char *data;
+    size_t size;
+    if (!nn__file_open(&r, file_path, &data, &size)) {
+        region_free(&r);
+        return false;
+    }
+    Nn_File_Header header;
+    memcpy(&header, data, sizeof(header));
+
+    bool ok = header.arch_count == nn.arch_count;
+    for (size_t i = 0; ok && i < nn.arch_count; ++i) {
+        uint64_t x;
+        memcpy(&x, data + nn__file_align(sizeof(header)) + sizeof(x)*i, sizeof(x));
+        ok = x == nn.arch[i];
+    }
+    if (!ok) fprintf(stderr, "ERROR: %s has a different arch\n", file_path);
+
+    // Everything is checked before anything is copied, so a failed load
+    // leaves the training state alone
+    const char *opt_data = NULL;
+    const char *train_data = NULL;
+    size_t offset = header.params_offset + nn__file_align(sizeof(float)*header.params_count);
+    while (ok && offset < size) {
+        Nn_File_Section section;
+        if (size - offset < nn__file_align(sizeof(section))) {
+            fprintf(stderr, "ERROR: %s has a corrupted section\n", file_path);
+            ok = false;
+            break;
+        }
+        memcpy(&section, data + offset, sizeof(section));
+        offset += nn__file_align(sizeof(section));
+        if (section.size > size - offset) {
+            fprintf(stderr, "ERROR: %s has a corrupted section\n", file_path);
+            ok = false;
+            break;
+        }
+        const char *payload = data + offset;
+        if (memcmp(section.tag, NN_FILE_TAG_OPT, sizeof(section.tag)) == 0 && opt != NULL) {
+            ok = nn__file_check_opt(file_path, payload, section.size, opt);
+            opt_data = payload;
+        } else if (memcmp(section.tag, NN_FILE_TAG_TRAIN, sizeof(section.tag)) == 0 && (b != NULL || epoch != NULL)) {
+            ok = nn__file_check_train(file_path, payload, section.size, b);
+            train_data = payload;
+        }
+        offset += nn__file_align(section.size);
+    }
+    if (ok && opt != NULL && opt_data == NULL) {
+        fprintf(stderr, "ERROR: %s has no optimizer state\n", file_path);
+        ok = false;
+    }
+    if (ok && (b != NULL || epoch != NULL) && train_data == NULL) {
+        fprintf(stderr, "ERROR: %s has no training state\n", file_path);
+        ok = false;
+    }
+
+    if (ok) {
+        memcpy(nn.params, data + header.params_offset, sizeof(*nn.params)*nn.params_count);
+        if (opt_data) nn__file_load_opt(opt_data, opt);
+        if (train_data) nn__file_load_train(train_data, b, epoch);
+    }
+
+#ifdef NN_REGION_MMAP
+    munmap(data, size);
+#endif // NN_REGION_MMAP
+    region_free(&r);
+    return ok;
+}
+
+struct Region_Block {
+    Region_Block *prev;
+    Region_Block *next;
+    size_t base;     // Offset of data in the whole chain, which is what region_save() counts in
+    size_t capacity; // Bytes of data
+    size_t size;     // Bytes of data in use
+    void *memory;    // What to free, NULL if the block lives inside of another Region
+    size_t mapped;   // Bytes to munmap, 0 if memory came from NN_MALLOC
+    char *data;
+};
+
+size_t region_footprint(size_t size_bytes)
+{
+    return (size_bytes + NN_REGION_ALIGNMENT - 1)/NN_REGION_ALIGNMENT*NN_REGION_ALIGNMENT;
+}
+
+static Region_Block *nn__region_block_alloc(size_t capacity, unsigned flags)
+{
+    size_t header = region_footprint(sizeof(Region_Block));
+    capacity = region_footprint(capacity);
+    void *memory = NULL;
+    size_t mapped = 0;
+
+#ifdef NN_REGION_MMAP
+    if (flags & (REGION_MMAP | REGION_HUGEPAGES)) {
+#ifdef MAP_HUGETLB
+        if (flags & REGION_HUGEPAGES) {
+            size_t bytes = (header + capacity + NN_HUGEPAGE_SIZE - 1)/NN_HUGEPAGE_SIZE*NN_HUGEPAGE_SIZE;
+            void *m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (m != MAP_FAILED) {
+                memory = m;
+                mapped = bytes;
+            }
+        }
+#endif // MAP_HUGETLB
+        if (memory == NULL) {
+            size_t page = (size_t) sysconf(_SC_PAGESIZE);
+            size_t bytes = (header + capacity + page - 1)/page*page;
+            void *m = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (m != MAP_FAILED) {
+                memory = m;
+                mapped = bytes;
+#ifdef MADV_HUGEPAGE
+                if (flags & REGION_HUGEPAGES) madvise(m, bytes, MADV_HUGEPAGE);
+#endif // MADV_HUGEPAGE
+            }
+        }
+        // Whatever is left of the last page is free real estate
+        if (memory != NULL) capacity = (mapped - header)/NN_REGION_ALIGNMENT*NN_REGION_ALIGNMENT;
+    }
+#else
+    (void) flags;
+#endif // NN_REGION_MMAP
+
+    char *start = memory;
+    if (memory == NULL) {
+        memory = NN_MALLOC(header + capacity + NN_REGION_ALIGNMENT - 1);
+        if (memory == NULL) return NULL;
+        uintptr_t p = (uintptr_t) memory;
+        start = (char*) ((p + NN_REGION_ALIGNMENT - 1) & ~(uintptr_t)(NN_REGION_ALIGNMENT - 1));
+    }
+
+    Region_Block *b = (Region_Block*) start;
+    memset(b, 0, sizeof(*b));
+    b->capacity = capacity;
+    b->memory = memory;
+    b->mapped = mapped;
+    b->data = start + header;
+    return b;
+}
+
+static void nn__region_block_free(Region_Block *b)
+{
+    void *memory = b->memory;
+#ifdef NN_REGION_MMAP
+    if (b->mapped > 0) {
+        munmap(memory, b->mapped);
+        return;
+    }
+#endif // NN_REGION_MMAP
+    if (memory != NULL) NN_FREE(memory);
+}
+
+Region region_alloc_alloc(size_t capacity_bytes)
+{
+    return region_alloc_alloc_flags(capacity_bytes, 0);
+}
+
+Region region_alloc_alloc_flags(size_t capacity_bytes, unsigned flags)
+{
+    Region r = {0};
+    r.flags = flags;
+    r.first = nn__region_block_alloc(capacity_bytes, flags);
+    NN_ASSERT(r.first != NULL);
+    r.current = r.first;
+    return r;
+}
+
+void region_free(Region *r)
+{
+    NN_ASSERT(r != NULL);
+    Region_Block *b = r->first;
+    while (b != NULL) {
+        Region_Block *next = b->next;
+        nn__region_block_free(b);
+        b = next;
+    }
+    r->first = NULL;
+    r->current = NULL;
+}
+
+void *region_alloc(Region *r, size_t size_bytes)
+{
+    if (r == NULL) return NN_MALLOC(size_bytes);
+    size_t size = region_footprint(size_bytes);
+
+    Region_Block *b = r->current;
+    while (b == NULL || b->size + size > b->capacity) {
+        // A block left behind by region_rewind()
+        if (b != NULL && b->next != NULL && b->next->capacity >= size) {
+            b = b->next;
+            b->size = 0;
+            continue;
+        }
+
+        NN_ASSERT(!(r->flags & REGION_FIXED) && "Region is out of memory");
+        if (r->flags & REGION_FIXED) return NULL;
+
+        // The blocks after b (if any) are too small for this allocation,
+        // so they are replaced with a new one
+        Region_Block *next = b != NULL ? b->next : r->first;
+        while (next != NULL) {
+            Region_Block *after = next->next;
+            nn__region_block_free(next);
+            next = after;
+        }
+
+        size_t capacity = NN_REGION_MIN_BLOCK;
+        if (b != NULL && capacity < b->capacity) capacity = b->capacity;
+        if (capacity < size) capacity = size;
+        Region_Block *nb = nn__region_block_alloc(capacity, r->flags);
+        NN_ASSERT(nb != NULL);
+        if (nb == NULL) return NULL;
+        nb->prev = b;
+        if (b != NULL) {
+            nb->base = b->base + b->capacity;
+            b->next = nb;
+        } else {
+            r->first = nb;
+        }
+        b = nb;
+    }
+
+    r->current = b;
+    void *result = b->data + b->size;
+    b->size += size;
+    return result;
+}
+
+size_t region_sub_bytes(size_t capacity_bytes)
+{
+    return region_footprint(sizeof(Region_Block)) + region_footprint(capacity_bytes);
+}
+
+Region region_sub(Region *r, size_t capacity_bytes)
+{
+    NN_ASSERT(r != NULL);
+    size_t header = region_footprint(sizeof(Region_Block));
+    size_t capacity = region_footprint(capacity_bytes);
+    char *memory = region_alloc(r, header + capacity);
+    NN_ASSERT(memory != NULL);
+
+    Region_Block *b = (Region_Block*) memory;
+    memset(b, 0, sizeof(*b));
+    b->capacity = capacity;
+    b->data = memory + header;
+
+    Region sub = {0};
+    sub.first = b;
+    sub.current = b;
+    sub.flags = REGION_FIXED;
+    return sub;
+}
+
+void region_reset(Region *r)
+{
+    region_rewind(r, 0);
+}
+
+size_t region_occupied_bytes(const Region *r)
+{
+    return region_save(r);
+}
+
+size_t region_save(const Region *r)
+{
+    NN_ASSERT(r != NULL);
+    if (r->current == NULL) return 0;
+    return r->current->base + r->current->size;
+}
+
+void region_rewind(Region *r, size_t s)
+{
+    NN_ASSERT(r != NULL);
+    Region_Block *b = r->current;
+    if (b == NULL) {
+        NN_ASSERT(s == 0);
+        return;
+    }
+    while (b->prev != NULL && b->base > s) b = b->prev;
+    NN_ASSERT(s >= b->base && s - b->base <= b->capacity);
+    b->size = s - b->base;
+    r->current = b;
 }
 
 Mat row_as_mat(Row row)
@@ -565,6 +3656,7 @@ Mat row_as_mat(Row row)
     return (Mat) {
         .rows = 1,
         .cols = row.cols,
+        .stride = row.cols,
         .elements = row.elements,
     };
 }
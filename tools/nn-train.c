@@ -0,0 +1,314 @@
+// Headless training: no raylib, no window, no frame pacing. Reads a text
+// dataset, trains flat out on all the cores and writes the model with
+// nn_save(), so it can run on machines without a display.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NN_THREADS
+#define NN_IMPLEMENTATION
+#include "nn.h"
+
+size_t max_epoch = 1000;
+size_t batch_size = 32;
+float rate = 1.0f;
+bool rate_given = false;
+Opt opt_kind = OPT_SGD;
+size_t threads = 0;
+size_t report_epochs = 100;
+const char *checkpoint_prefix = NULL;
+size_t checkpoint_epochs = 100;
+
+char *args_shift(int *argc, char ***argv)
+{
+    NN_ASSERT(*argc > 0);
+    char *result = **argv;
+    (*argc) -= 1;
+    (*argv) += 1;
+    return result;
+}
+
+void usage(FILE *stream, const char *program)
+{
+    fprintf(stream, "Usage: %s [OPTIONS] <arch> <data> <output>\n", program);
+    fprintf(stream, "    <arch>      sizes of the layers, e.g. 2,4,1\n");
+    fprintf(stream, "    <data>      text file with one sample per line, the inputs followed by the outputs\n");
+    fprintf(stream, "    <output>    where the trained model is saved\n");
+    fprintf(stream, "OPTIONS:\n");
+    fprintf(stream, "    -e <n>      amount of epochs (default %zu)\n", max_epoch);
+    fprintf(stream, "    -b <n>      batch size (default %zu)\n", batch_size);
+    fprintf(stream, "    -r <f>      learning rate, overrides the one of the checkpoint when resuming (default %g)\n", rate);
+    fprintf(stream, "    -o <opt>    sgd, momentum, rmsprop or adam (default sgd)\n");
+    fprintf(stream, "    -j <n>      worker threads, 0 for one per CPU (default %zu)\n", threads);
+    fprintf(stream, "    -p <n>      epochs between the reports (default %zu)\n", report_epochs);
+    fprintf(stream, "    -c <prefix> checkpoint to <prefix>-<n>.nn and resume from the newest one\n");
+    fprintf(stream, "    -k <n>      epochs between the checkpoints (default %zu)\n", checkpoint_epochs);
+    fprintf(stream, "    -s <n>      seed of the initial parameters and the shuffles (default time)\n");
+}
+
+bool parse_size(const char *s, size_t *out)
+{
+    char *end;
+    unsigned long long x = strtoull(s, &end, 10);
+    if (end == s || *end != '\0' || s[0] == '-') return false;
+    *out = x;
+    return true;
+}
+
+bool parse_arch(const char *s, size_t **arch, size_t *arch_count)
+{
+    size_t count = 1;
+    for (const char *p = s; *p; ++p) {
+        if (*p == ',') count += 1;
+    }
+    *arch = malloc(sizeof(**arch)*count);
+    NN_ASSERT(*arch != NULL);
+    *arch_count = count;
+
+    for (size_t i = 0; i < count; ++i) {
+        char *end;
+        unsigned long long x = strtoull(s, &end, 10);
+        if (end == s || x == 0 || (*end != ',' && *end != '\0')) return false;
+        (*arch)[i] = x;
+        s = end + 1;
+    }
+    return count >= 2;
+}
+
+char *read_entire_file(const char *file_path)
+{
+    FILE *f = fopen(file_path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "ERROR: could not open %s: %s\n", file_path, strerror(errno));
+        return NULL;
+    }
+    long size = -1;
+    if (fseek(f, 0, SEEK_END) == 0) size = ftell(f);
+    if (size < 0 || fseek(f, 0, SEEK_SET) != 0) {
+        fprintf(stderr, "ERROR: could not get the size of %s\n", file_path);
+        fclose(f);
+        return NULL;
+    }
+    char *data = malloc(size + 1);
+    NN_ASSERT(data != NULL);
+    bool ok = fread(data, 1, size, f) == (size_t) size;
+    fclose(f);
+    if (!ok) {
+        fprintf(stderr, "ERROR: could not read %s\n", file_path);
+        free(data);
+        return NULL;
+    }
+    data[size] = '\0';
+    return data;
+}
+
+// Every line that isn't empty or a # comment is a row of exactly cols floats
+bool load_data(const char *file_path, size_t cols, Mat *t)
+{
+    char *data = read_entire_file(file_path);
+    if (data == NULL) return false;
+
+    size_t rows = 0;
+    for (char *line = data; *line; ) {
+        char *next = strchr(line, '\n');
+        size_t n = next ? (size_t) (next - line) : strlen(line);
+        size_t i = strspn(line, " \t\r");
+        if (i < n && line[i] != '#') rows += 1;
+        line += next ? n + 1 : n;
+    }
+    if (rows == 0) {
+        fprintf(stderr, "ERROR: %s has no samples\n", file_path);
+        free(data);
+        return false;
+    }
+
+    *t = mat_alloc(NULL, rows, cols);
+    size_t row = 0;
+    size_t line_number = 0;
+    for (char *line = data; *line; ) {
+        line_number += 1;
+        char *next = strchr(line, '\n');
+        if (next) *next = '\0';
+        size_t i = strspn(line, " \t\r");
+        if (line[i] != '\0' && line[i] != '#') {
+            char *p = line;
+            for (size_t col = 0; col < cols; ++col) {
+                char *end;
+                MAT_AT(*t, row, col) = strtof(p, &end);
+                if (end == p) {
+                    fprintf(stderr, "%s:%zu: ERROR: expected %zu numbers\n", file_path, line_number, cols);
+                    free(data);
+                    return false;
+                }
+                p = end;
+            }
+            p += strspn(p, " \t\r");
+            if (*p != '\0') {
+                fprintf(stderr, "%s:%zu: ERROR: expected %zu numbers\n", file_path, line_number, cols);
+                free(data);
+                return false;
+            }
+            row += 1;
+        }
+        line = next ? next + 1 : line + strlen(line);
+    }
+    free(data);
+    return true;
+}
+
+double now_secs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec*1e-9;
+}
+
+int main(int argc, char **argv)
+{
+    const char *program = args_shift(&argc, &argv);
+    const char *positional[3];
+    size_t positional_count = 0;
+    size_t seed = time(NULL);
+
+    while (argc > 0) {
+        const char *flag = args_shift(&argc, &argv);
+        if (flag[0] != '-' || flag[1] == '\0') {
+            if (positional_count >= ARRAY_LEN(positional)) {
+                usage(stderr, program);
+                fprintf(stderr, "ERROR: unexpected argument %s\n", flag);
+                return 1;
+            }
+            positional[positional_count++] = flag;
+            continue;
+        }
+        if (strcmp(flag, "-h") == 0 || strcmp(flag, "--help") == 0) {
+            usage(stdout, program);
+            return 0;
+        }
+        if (argc <= 0) {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: no value is provided for %s\n", flag);
+            return 1;
+        }
+        const char *value = args_shift(&argc, &argv);
+        bool ok = true;
+        if (strcmp(flag, "-e") == 0) {
+            ok = parse_size(value, &max_epoch);
+        } else if (strcmp(flag, "-b") == 0) {
+            ok = parse_size(value, &batch_size) && batch_size > 0;
+        } else if (strcmp(flag, "-r") == 0) {
+            char *end;
+            rate = strtof(value, &end);
+            ok = end != value && *end == '\0';
+            rate_given = true;
+        } else if (strcmp(flag, "-o") == 0) {
+            if (strcmp(value, "sgd") == 0) opt_kind = OPT_SGD;
+            else if (strcmp(value, "momentum") == 0) opt_kind = OPT_MOMENTUM;
+            else if (strcmp(value, "rmsprop") == 0) opt_kind = OPT_RMSPROP;
+            else if (strcmp(value, "adam") == 0) opt_kind = OPT_ADAM;
+            else ok = false;
+        } else if (strcmp(flag, "-j") == 0) {
+            ok = parse_size(value, &threads);
+        } else if (strcmp(flag, "-p") == 0) {
+            ok = parse_size(value, &report_epochs) && report_epochs > 0;
+        } else if (strcmp(flag, "-c") == 0) {
+            checkpoint_prefix = value;
+        } else if (strcmp(flag, "-k") == 0) {
+            ok = parse_size(value, &checkpoint_epochs) && checkpoint_epochs > 0;
+        } else if (strcmp(flag, "-s") == 0) {
+            ok = parse_size(value, &seed);
+        } else {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: unknown flag %s\n", flag);
+            return 1;
+        }
+        if (!ok) {
+            usage(stderr, program);
+            fprintf(stderr, "ERROR: invalid value %s for %s\n", value, flag);
+            return 1;
+        }
+    }
+    if (positional_count < ARRAY_LEN(positional)) {
+        usage(stderr, program);
+        fprintf(stderr, "ERROR: expected <arch>, <data> and <output>\n");
+        return 1;
+    }
+    const char *arch_arg = positional[0];
+    const char *data_file_path = positional[1];
+    const char *out_file_path = positional[2];
+
+    size_t *arch;
+    size_t arch_count;
+    if (!parse_arch(arch_arg, &arch, &arch_count)) {
+        fprintf(stderr, "ERROR: invalid arch %s, expected at least two positive sizes separated by commas\n", arch_arg);
+        return 1;
+    }
+
+    Mat t;
+    if (!load_data(data_file_path, arch[0] + arch[arch_count - 1], &t)) return 1;
+
+    srand(seed);
+    nn_threads_set_count(threads);
+
+    NN nn = nn_alloc(NULL, arch, arch_count);
+    nn_rand(nn, -1, 1);
+    Optimizer opt = optimizer_alloc(NULL, nn, opt_kind, rate);
+    Workspace ws = workspace_alloc(NULL, arch, arch_count, batch_size);
+    Batch batch = {0};
+    batch_order_alloc(NULL, &batch, t.rows);
+    size_t epoch = 0;
+
+    Checkpoint *checkpoint = NULL;
+    if (checkpoint_prefix != NULL) {
+        checkpoint = checkpoint_alloc(NULL, checkpoint_prefix, 3, nn, &opt, &batch);
+        Checkpoint_Resume resume = checkpoint_resume(checkpoint, nn, &opt, &batch, &epoch);
+        if (resume == CHECKPOINT_FAILED) {
+            // Training from scratch would quietly throw away whatever they were
+            fprintf(stderr, "ERROR: could not resume from the checkpoints %s-*.nn, move them away to start over\n", checkpoint_prefix);
+            checkpoint_free(checkpoint);
+            return 1;
+        }
+        if (resume == CHECKPOINT_RESUMED) {
+            printf("Resumed from epoch %zu\n", epoch);
+            // The checkpoint brings back its own rate, which -r is meant to change
+            if (rate_given) opt.rate = rate;
+        }
+    }
+
+    printf("Training %zu parameters on %zu samples with %zu threads\n", nn.params_count, t.rows, nn_threads_count());
+
+    double start = now_secs();
+    double report_start = start;
+    size_t report_rows = 0;
+    size_t total_rows = 0;
+    while (epoch < max_epoch) {
+        // batch_process() starts over once the previous batch finished the epoch
+        size_t begin = batch.finished ? 0 : batch.begin;
+        batch_process(&ws, &batch, nn, t, &opt);
+        size_t rows = batch.finished ? t.rows - begin : batch_size;
+        report_rows += rows;
+        total_rows += rows;
+        if (batch.finished) {
+            epoch += 1;
+            batch_shuffle(&batch);
+            if (epoch%report_epochs == 0 || epoch == max_epoch) {
+                double now = now_secs();
+                printf("Epoch %zu/%zu, Cost: %f, %.0f samples/s\n", epoch, max_epoch, batch.cost, report_rows/(now - report_start));
+                fflush(stdout);
+                report_start = now;
+                report_rows = 0;
+            }
+            if (checkpoint != NULL && epoch%checkpoint_epochs == 0) {
+                checkpoint_save(checkpoint, nn, &opt, &batch, epoch);
+            }
+        }
+    }
+    double elapsed = now_secs() - start;
+    printf("Trained %zu samples in %.3fs, %.0f samples/s\n", total_rows, elapsed, elapsed > 0 ? total_rows/elapsed : 0);
+
+    if (checkpoint != NULL) checkpoint_free(checkpoint);
+    if (!nn_save(out_file_path, nn)) return 1;
+    printf("Saved %s\n", out_file_path);
+    return 0;
+}